@@ -4,8 +4,29 @@
 #include <stdarg.h>
 #include <stdbool.h>
 
+#include <errno.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <unistd.h>
+
+#include <signal.h>
+#include <pthread.h>
+
+#include <limits.h>
+
 #include <sys/types.h>
-#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "lambdapp-internal.h"
+
+/* F_SETPIPE_SZ is only declared for _GNU_SOURCE */
+#if defined(__linux__) && !defined(F_SETPIPE_SZ)
+#   define F_SETPIPE_SZ 1031
+#endif
+#define LCC_PIPE_SIZE (1 << 20)
+
+extern char **environ;
 
 #define PP_ARRAY_COUNT(ARRAY) \
     (sizeof((ARRAY))/sizeof(*(ARRAY)))
@@ -13,7 +34,7 @@
     for (size_t NAME = 0; NAME < PP_ARRAY_COUNT(ARRAY); NAME++)
 
 static void lcc_usage(const char *app) {
-    fprintf(stderr, "%s usage: [cc options]\n", app);
+    fprintf(stderr, "%s usage: [-j N] [--stable-names] [--dedupe] [--inline] [--cxx] [--markers=MODE] [--lpp-files] [--stats[=FILE]] [--trace=FILE] [cc options]\n", app);
 }
 
 static void lcc_error(const char *message,  ...) {
@@ -25,99 +46,270 @@ static void lcc_error(const char *message,  ...) {
     va_end(va);
 }
 
+/* Argument vectors for the programs we spawn, always null terminated */
 typedef struct {
-    const char *file;
-    size_t      index;
-    bool        cpp;
-} lcc_source_t;
-
-typedef struct {
-    const char *output;
-    size_t      index;
-    bool        aout;
-} lcc_output_t;
-
-typedef struct {
-    char   *buffer;
+    char  **data;
     size_t  used;
     size_t  allocated;
-} lcc_string_t;
+} lcc_args_t;
 
-static bool lcc_string_init(lcc_string_t *string) {
-    if (!(string->buffer = malloc(64)))
+static bool lcc_args_init(lcc_args_t *args) {
+    if (!(args->data = malloc(sizeof(char *) * 16)))
         return false;
-    string->buffer[0] = '\0';
-    string->used      = 1; /* always use the null byte */
-    string->allocated = 64;
-    return 1;
+    args->data[0]   = NULL;
+    args->used      = 0;
+    args->allocated = 16;
+    return true;
 }
 
-static bool lcc_string_resize(lcc_string_t *string) {
-    size_t request = string->allocated * 2;
-    void  *attempt = realloc(string->buffer, request);
-    if (!attempt)
-        return false;
-    string->allocated = request;
-    string->buffer    = attempt;
+static bool lcc_args_push(lcc_args_t *args, char *arg) {
+    if (args->used + 1 == args->allocated) {
+        size_t request = args->allocated * 2;
+        void  *attempt = realloc(args->data, sizeof(char *) * request);
+        if (!attempt)
+            return false;
+        args->allocated = request;
+        args->data      = attempt;
+    }
+    args->data[args->used++] = arg;
+    args->data[args->used]   = NULL;
     return true;
 }
 
-static bool lcc_string_appendf(lcc_string_t *string, const char *message, ...) {
-    va_list va1, va2;
-    va_start(va1, message);
-    va_copy(va2, va1); /* Copy the list */
-    size_t count = vsnprintf(NULL, 0, message, va1);
-    while (string->used + count >= string->allocated) {
-        if (!lcc_string_resize(string))
-            return false;
+static void lcc_args_destroy(lcc_args_t *args) {
+    free(args->data);
+}
+
+/* $CC may be a command with arguments of its own like "ccache gcc", the words
+ * are split off a copy which lives as long as the arguments.
+ */
+static char *lcc_args_command(lcc_args_t *args, const char *command) {
+    char *copy = strdup(command);
+    if (!copy)
+        return NULL;
+    for (char *word = strtok(copy, " \t"); word; word = strtok(NULL, " \t")) {
+        if (!lcc_args_push(args, word)) {
+            free(copy);
+            return NULL;
+        }
+    }
+    return copy;
+}
+
+#ifndef _NDEBUG
+/* Exit status of a child like the shell would report it */
+static int lcc_wait(pid_t pid) {
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR)
+            return 1;
+    }
+    if (WIFEXITED(status))
+        return WEXITSTATUS(status);
+    if (WIFSIGNALED(status))
+        return 128 + WTERMSIG(status);
+    return 1;
+}
+
+/* Pipes are created close-on-exec while holding the lock children are spawned
+ * with, so that no compiler inherits the pipe of another one and never sees
+ * the end of its input.
+ */
+static pthread_mutex_t lcc_spawn_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool lcc_pipe(int pipes[2]) {
+    pthread_mutex_lock(&lcc_spawn_lock);
+    bool success = !pipe(pipes);
+    if (success) {
+        fcntl(pipes[0], F_SETFD, FD_CLOEXEC);
+        fcntl(pipes[1], F_SETFD, FD_CLOEXEC);
     }
-    va_end(va1);
+    pthread_mutex_unlock(&lcc_spawn_lock);
+    return success;
+}
 
-    va_start(va2, message);
-    vsnprintf(string->buffer + string->used - 1, count + 1, message, va2);
-    va_end(va2);
-    string->used += count;
+static bool lcc_spawn(pid_t *pid, char **argv, int in, int out, int close_fd) {
+    posix_spawn_file_actions_t actions;
+    if (posix_spawn_file_actions_init(&actions))
+        return false;
+    bool success = true;
+    if (in >= 0)
+        success &= !posix_spawn_file_actions_adddup2(&actions, in, STDIN_FILENO)
+                && !posix_spawn_file_actions_addclose(&actions, in);
+    if (out >= 0)
+        success &= !posix_spawn_file_actions_adddup2(&actions, out, STDOUT_FILENO)
+                && !posix_spawn_file_actions_addclose(&actions, out);
+    if (close_fd >= 0)
+        success &= !posix_spawn_file_actions_addclose(&actions, close_fd);
+    pthread_mutex_lock(&lcc_spawn_lock);
+    int error = success ? posix_spawnp(pid, argv[0], &actions, NULL, argv, environ) : ENOMEM;
+    pthread_mutex_unlock(&lcc_spawn_lock);
+    posix_spawn_file_actions_destroy(&actions);
+    if (error) {
+        lcc_error("Failed to run %s: %s", argv[0], strerror(error));
+        return false;
+    }
     return true;
 }
 
-static void lcc_string_destroy(lcc_string_t *string) {
-    free(string->buffer);
+/* Translates the opened source into fd with the built-in lambda-pp, closes
+ * both when done. The output is streamed unless the source is parsed on
+ * multiple threads.
+ */
+static bool lcc_translate(lambda_source_t *source, int fd) {
+    lambda_arena_t   arena;
+    lambda_output_t *out = output_create();
+    bool             success = false;
+
+    if (!out) {
+        lcc_error("Out of memory");
+    } else {
+        lambda_arena_init(&arena);
+        output_init(out, fd);
+        success = generate(out, source, &arena, source->jobs <= 1);
+        lambda_arena_destroy(&arena);
+    }
+    parse_close(source);
+    output_destroy(out);
+    close(fd);
+    return success;
+}
+#else
+static void lcc_print(char **argv) {
+    for (size_t i = 0; argv[i]; i++)
+        printf(i ? " %s" : "%s", argv[i]);
 }
+#endif
 
-static const char *lcc_lambdapp_find(void) {
-    char *search;
-    if ((search = getenv("LAMBDA_PP")))
-        return search;
+/* The search path, or where a shell would look without one */
+static const char *lcc_path(void) {
+    const char *path = getenv("PATH");
+    return path && *path ? path : "/bin:/usr/bin";
+}
 
-    static const char *bins[] = {
-        ".", /* Try reliative to ourselfs as well */
-        "/bin",
-        "/usr/bin",
-        
-        /* When lambdapp is included as a submodule in a project */
-        "lambdapp"
-    };
+/* Whether dir (of length bytes) contains the program name, its path is left
+ * in buffer.
+ */
+static bool lcc_executable(const char *dir, size_t length, const char *name, char *buffer, size_t size) {
+    if (!length) {
+        dir    = "."; /* an empty entry of the search path */
+        length = 1;
+    }
+    if (length + strlen(name) + 2 > size)
+        return false;
+    memcpy(buffer, dir, length);
+    buffer[length] = '/';
+    strcpy(buffer + length + 1, name);
 
-    PP_ARRAY_FOR(bin, bins) {
-        DIR *dir = opendir(bins[bin]);
-        if (!dir)
-            continue;
+    struct stat st;
+    return !stat(buffer, &st) && S_ISREG(st.st_mode) && !access(buffer, X_OK);
+}
 
-        struct dirent *entry;
-        while ((entry = readdir(dir))) {
-            if (entry->d_type != DT_REG && entry->d_type != DT_LNK)
-                continue;
+static const char *lcc_lambdapp_find(const char *self) {
+    static char found[PATH_MAX];
+    char        buffer[PATH_MAX];
+    char       *search;
+    if ((search = getenv("LAMBDA_PP")) && *search)
+        return search;
 
-            if (!strcmp(entry->d_name, "lambda-pp")) {
-                closedir(dir);
-                return bins[bin];
-            }
+    /* Try relative to ourselfs first, then the working directory, the search
+     * path and where lambdapp is included as a submodule in a project.
+     */
+    const char *slash = strrchr(self, '/');
+    if (slash && lcc_executable(self, slash - self, "lambda-pp", buffer, sizeof(buffer))) {
+        memcpy(found, self, slash - self);
+        found[slash - self] = '\0';
+        return found;
+    }
+    if (lcc_executable(".", 1, "lambda-pp", buffer, sizeof(buffer)))
+        return ".";
+    for (const char *dir = lcc_path(); *dir; ) {
+        size_t length = strcspn(dir, ":");
+        if (lcc_executable(dir, length, "lambda-pp", buffer, sizeof(buffer)) && length < sizeof(found)) {
+            memcpy(found, dir, length);
+            found[length] = '\0';
+            return length ? found : ".";
         }
-        closedir(dir);
+        dir += length + (dir[length] == ':');
     }
+    if (lcc_executable("lambdapp", 8, "lambda-pp", buffer, sizeof(buffer)))
+        return "lambdapp";
     return NULL;
 }
 
+/* The compiler found on the search path can be kept in the file named by
+ * $LAMBDA_CC_TOOLCHAIN. It holds the search path, the compiler and the times
+ * the directories which were searched were last modified; adding or removing
+ * a program changes those.
+ */
+#define LCC_TOOLCHAIN_MAGIC "lambda-cc toolchain 1"
+
+static bool lcc_toolchain_line(FILE *file, char *buffer, size_t size) {
+    if (!fgets(buffer, size, file))
+        return false;
+    size_t length = strlen(buffer);
+    if (!length || buffer[length - 1] != '\n')
+        return false;
+    buffer[length - 1] = '\0';
+    return true;
+}
+
+static bool lcc_toolchain_load(const char *cache, const char *path, char *name, size_t size) {
+    char  buffer[PATH_MAX + 64];
+    FILE *file = fopen(cache, "r");
+    if (!file)
+        return false;
+
+    bool valid = lcc_toolchain_line(file, buffer, sizeof(buffer)) && !strcmp(buffer, LCC_TOOLCHAIN_MAGIC)
+              && lcc_toolchain_line(file, buffer, sizeof(buffer)) && !strcmp(buffer, path)
+              && lcc_toolchain_line(file, name, size) && *name;
+    while (valid && lcc_toolchain_line(file, buffer, sizeof(buffer))) {
+        char      *dir;
+        long long  seconds     = strtoll(buffer, &dir, 10);
+        long       nanoseconds = strtol(dir, &dir, 10);
+        struct stat st;
+        if (*dir++ != ' ')
+            valid = false;
+        else if (stat(dir, &st))
+            valid = seconds == -1;
+        else
+            valid = seconds == (long long)st.st_mtim.tv_sec && nanoseconds == st.st_mtim.tv_nsec;
+    }
+    fclose(file);
+    return valid;
+}
+
+/* Written to a temporary file which is renamed over the old one */
+static void lcc_toolchain_save(const char *cache, const char *path, size_t searched, const char *name) {
+    char temporary[PATH_MAX];
+    if (snprintf(temporary, sizeof(temporary), "%s.XXXXXX", cache) >= (int)sizeof(temporary))
+        return;
+    int fd = mkstemp(temporary);
+    if (fd < 0)
+        return;
+    FILE *file = fdopen(fd, "w");
+    if (!file) {
+        close(fd);
+        unlink(temporary);
+        return;
+    }
+
+    fprintf(file, LCC_TOOLCHAIN_MAGIC "\n%s\n%s\n", path, name);
+    for (const char *dir = path; searched--; ) {
+        size_t      length = strcspn(dir, ":");
+        char        buffer[PATH_MAX];
+        struct stat st;
+        snprintf(buffer, sizeof(buffer), "%.*s", (int)length, length ? dir : ".");
+        if (stat(buffer, &st))
+            fprintf(file, "-1 0 %s\n", buffer);
+        else
+            fprintf(file, "%lld %ld %s\n", (long long)st.st_mtim.tv_sec, (long)st.st_mtim.tv_nsec, buffer);
+        dir += length + (dir[length] == ':');
+    }
+    if (fclose(file) || rename(temporary, cache))
+        unlink(temporary);
+}
+
 static const char *lcc_compiler_find(void) {
     /* Try enviroment variables first */
     char *search;
@@ -126,41 +318,50 @@ static const char *lcc_compiler_find(void) {
     if ((search = getenv("CXX")))
         return search;
 
-    /* Start searching toolchain directories */
-    static const char *bins[] = {
-        "/bin",
-        "/usr/bin",
-    };
-
     static const char *ccs[] = {
         "cc", "gcc", "clang", "pathcc", "tcc"
     };
 
-    PP_ARRAY_FOR(bin, bins) {
-        DIR *dir = opendir(bins[bin]);
-        if (!dir)
-            continue;
+    static char found[64];
+    const char *path  = lcc_path();
+    const char *cache = getenv("LAMBDA_CC_TOOLCHAIN");
+    if (cache && *cache && strlen(path) < PATH_MAX && lcc_toolchain_load(cache, path, found, sizeof(found)))
+        return found;
 
+    /* Search the toolchain directories in order */
+    size_t searched = 0;
+    for (const char *dir = path; *dir; ) {
+        size_t length = strcspn(dir, ":");
+        char   buffer[PATH_MAX];
+        searched++;
         PP_ARRAY_FOR(cc, ccs) {
-            /* Scan the directory for one of the CCs */
-            struct dirent *entry;
-            while ((entry = readdir(dir))) {
-                /* Ignore things which are not files */
-                if (entry->d_type != DT_REG && entry->d_type != DT_LNK)
-                    continue;
-                if (!strcmp(entry->d_name, ccs[cc])) {
-                    closedir(dir);
-                    return ccs[cc];
-                }
-            }
+            if (!lcc_executable(dir, length, ccs[cc], buffer, sizeof(buffer)))
+                continue;
+            if (cache && *cache && strlen(path) < PATH_MAX)
+                lcc_toolchain_save(cache, path, searched, ccs[cc]);
+            return ccs[cc];
         }
-        closedir(dir);
+        dir += length + (dir[length] == ':');
     }
 
     return NULL;
 }
 
-static bool lcc_source_find(int argc, char **argv, lcc_source_t *source) {
+/* Options which take the next argument as their value */
+static bool lcc_option_value(const char *arg) {
+    static const char *options[] = {
+        "-o", "-x", "-I", "-D", "-U", "-L", "-l", "-include", "-imacros",
+        "-isystem", "-iquote", "-idirafter", "-MF", "-MT", "-MQ", "-Xlinker",
+        "-Xpreprocessor", "-Xassembler", "-j"
+    };
+    PP_ARRAY_FOR(option, options) {
+        if (!strcmp(arg, options[option]))
+            return true;
+    }
+    return false;
+}
+
+static bool lcc_source_is(const char *arg, bool *cpp) {
     static const char *exts[] = {
         /* C file extensions */
         ".c",
@@ -169,41 +370,553 @@ static bool lcc_source_find(int argc, char **argv, lcc_source_t *source) {
         ".cc", ".cx", ".cxx", ".cpp",
     };
 
-    for (int i = 0; i < argc; i++) {
-        PP_ARRAY_FOR(ext, exts) {
-            char *find = strstr(argv[i], exts[ext]);
-            if (!find)
-                continue;
-
-            /* It could be named stupidly like foo.c.c so we scan the whole filename
-             * until we reach the end (when strcmp will succeed).
-             */
-            while (find) {
-                /* Make sure it's the end of the string */
-                if (!strcmp(find, exts[ext])) {
-                    source->index = i;
-                    source->file  = argv[i];
-                    source->cpp   = (ext >= 1); /* See table of sources above for when this is valid. */
-                    return true;
-                }
-                find = strstr(find + strlen(exts[ext]), exts[ext]);
-            }
+    /* It could be named stupidly like foo.c.c, only the end matters */
+    size_t length = strlen(arg);
+    PP_ARRAY_FOR(ext, exts) {
+        size_t extlength = strlen(exts[ext]);
+        if (length > extlength && !strcmp(arg + length - extlength, exts[ext])) {
+            *cpp = (ext >= 1); /* See table of sources above for when this is valid. */
+            return true;
         }
     }
     return false;
 }
 
-static bool lcc_output_find(int argc, char **argv, lcc_output_t *output) {
-    for (int i = 0; i < argc; i++) {
-        if (strcmp(argv[i], "-o"))
-            continue;
-        if (i + 1 >= argc) /* expecting output */
-            return false;
-        output->index  = i;
-        output->output = argv[i + 1];
+/* Arguments which only matter to the linker */
+static bool lcc_link_only(const char *arg) {
+    if (arg[0] != '-')
+        return true; /* objects and libraries */
+    return !strncmp(arg, "-l", 2) || !strncmp(arg, "-L", 2) || !strncmp(arg, "-Wl,", 4)
+        || !strcmp(arg, "-Xlinker");
+}
+
+typedef struct {
+    const char *file;
+    size_t      index;
+    bool        cpp;
+    char       *output; /* where the compiler writes to */
+    bool        temporary;
+    char       *translation; /* --lpp-files: the file the compiler reads */
+    char       *depfile;     /* written by the compiler, names the translation */
+    unsigned    tid;       /* of the worker which compiled it */
+    lambda_stats_t stats;  /* of the in-process translation */
+    lambda_span_t  translate;
+    lambda_span_t  spawn;
+    lambda_span_t  compile; /* from spawning the compiler until it exited */
+} lcc_source_t;
+
+typedef struct {
+    lcc_args_t      flags;     /* arguments for the compiler without the sources */
+    char           *lambdapp;  /* the external lambda-pp or NULL */
+    const char     *server;
+    const char     *cache;     /* LAMBDAPP_CACHE_DIR */
+    bool            stable;    /* --stable-names */
+    bool            dedupe;    /* --dedupe */
+    bool            inlined;   /* --inline */
+    bool            cxx;       /* --cxx, for C++ sources only */
+    size_t          jobs;      /* threads to parse a single source on */
+    const char     *markers;   /* the --markers=MODE argument */
+    bool            files;     /* --lpp-files */
+    size_t          words;     /* of the compiler command at the start of the arguments */
+    bool            stats;     /* --stats */
+    int             json;      /* --stats=FILE, -1 for none */
+    lambda_trace_t *trace;     /* --trace=FILE */
+    lcc_source_t   *sources;
+    size_t          count;
+    size_t          next;
+    unsigned        workers;
+    int             status;
+    pthread_mutex_t mutex;
+} lcc_build_t;
+
+static bool lcc_reporting(const lcc_build_t *build) {
+    return build->stats || build->json >= 0 || build->trace;
+}
+
+static double lcc_ms(const lambda_span_t *span) {
+    return span->duration / 1e6;
+}
+
+static void lcc_span_end(lambda_span_t *span) {
+    span->duration = lambda_clock() - span->begin;
+}
+
+/* Reports the timings of a compiled source, along with the statistics of its
+ * translation when that happened in-process.
+ */
+static void lcc_report_source(const lcc_build_t *build, const lcc_source_t *source) {
+    bool translated = !build->lambdapp && source->stats.generate.begin;
+    if (build->stats) {
+        if (translated)
+            lambda_stats_print(STDERR_FILENO, source->file, &source->stats);
+        fprintf(stderr, "%s: translate %.3fms, spawn %.3fms, compile %.3fms\n",
+            source->file, lcc_ms(&source->translate), lcc_ms(&source->spawn), lcc_ms(&source->compile));
+    }
+    if (build->json >= 0) {
+        char   line[8192];
+        size_t length = lambda_json_string(line + 9, sizeof(line) - 9, source->file) + 9;
+        memcpy(line, "{\"file\": ", 9);
+        if (length < sizeof(line))
+            length += snprintf(line + length, sizeof(line) - length,
+                ", \"translate_ns\": %llu, \"spawn_ns\": %llu, \"compile_ns\": %llu}\n",
+                (unsigned long long)source->translate.duration, (unsigned long long)source->spawn.duration,
+                (unsigned long long)source->compile.duration);
+        if ((translated && !lambda_stats_json(build->json, source->file, &source->stats))
+            || length >= sizeof(line) || write(build->json, line, length) != (ssize_t)length)
+            lcc_error("Failed to write the statistics of %s", source->file);
+    }
+    if (build->trace) {
+        if (translated) {
+            lambda_trace_event(build->trace, "open", source->file, &source->stats.open, source->tid);
+            lambda_trace_event(build->trace, "parse", source->file, &source->stats.parse, source->tid);
+        }
+        lambda_trace_event(build->trace, "translate", source->file, &source->translate, source->tid);
+        lambda_trace_event(build->trace, "spawn", source->file, &source->spawn, source->tid);
+        lambda_trace_event(build->trace, "compile", source->file, &source->compile, source->tid);
+    }
+}
+
+/* Reports the steps of the build which aren't about any one source */
+static void lcc_report_step(const lcc_build_t *build, const char *name, const lambda_span_t *span) {
+    if (build->stats)
+        fprintf(stderr, "lambda-cc: %s %.3fms\n", name, lcc_ms(span));
+    if (build->json >= 0)
+        dprintf(build->json, "{\"step\": \"%s\", \"duration_ns\": %llu}\n", name, (unsigned long long)span->duration);
+    if (build->trace)
+        lambda_trace_event(build->trace, name, NULL, span, 0);
+}
+
+/* foo/bar.c becomes bar<ext> */
+static char *lcc_output_name(const char *file, const char *ext) {
+    const char *name = strrchr(file, '/');
+    name = name ? name + 1 : file;
+    const char *dot = strrchr(name, '.');
+    size_t length = dot ? (size_t)(dot - name) : strlen(name);
+    char *output = malloc(length + strlen(ext) + 1);
+    if (!output)
+        return NULL;
+    memcpy(output, name, length);
+    strcpy(output + length, ext);
+    return output;
+}
+
+/* Objects of sources which are compiled and linked in one go */
+static char *lcc_output_temporary(void) {
+    const char *dir = getenv("TMPDIR");
+    if (!dir || !*dir)
+        dir = "/tmp";
+    char *output = malloc(strlen(dir) + sizeof("/lambda-cc-XXXXXX.o"));
+    if (!output)
+        return NULL;
+    strcpy(output, dir);
+    strcat(output, "/lambda-cc-XXXXXX.o");
+    int fd = mkstemps(output, 2);
+    if (fd < 0) {
+        free(output);
+        return NULL;
+    }
+    close(fd);
+    return output;
+}
+
+/* build/foo.o becomes build/foo<ext> */
+static char *lcc_output_sibling(const char *output, const char *ext) {
+    const char *name = strrchr(output, '/');
+    name = name ? name + 1 : output;
+    const char *dot = strrchr(name, '.');
+    size_t length = dot ? (size_t)(dot - output) : strlen(output);
+    char *sibling = malloc(length + strlen(ext) + 1);
+    if (!sibling)
+        return NULL;
+    memcpy(sibling, output, length);
+    strcpy(sibling + length, ext);
+    return sibling;
+}
+
+#ifndef _NDEBUG
+/* Paths in dependency files have spaces and '#' escaped with a backslash and
+ * '$' with another one.
+ */
+static char *lcc_depfile_escape(const char *path) {
+    char *escaped = malloc(strlen(path) * 2 + 1);
+    if (!escaped)
+        return NULL;
+    char *to = escaped;
+    for (; *path; path++) {
+        if (*path == ' ' || *path == '#')
+            *to++ = '\\';
+        else if (*path == '$')
+            *to++ = '$';
+        *to++ = *path;
+    }
+    *to = '\0';
+    return escaped;
+}
+
+static bool lcc_depfile_separator(const char *data, size_t length, size_t at) {
+    if (at == length)
         return true;
+    char c = data[at];
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == ':'
+        || (c == '\\' && at + 1 < length && data[at + 1] == '\n');
+}
+
+/* The compiler names the translation in the dependency file where the
+ * source should be.
+ */
+static bool lcc_depfile_rewrite(const char *depfile, const char *translation, const char *file) {
+    FILE *in   = fopen(depfile, "rb");
+    char *data = NULL;
+    long  size = -1;
+    bool  read = in && !fseek(in, 0, SEEK_END) && (size = ftell(in)) >= 0 && !fseek(in, 0, SEEK_SET)
+              && (data = malloc(size + 1)) && fread(data, 1, size, in) == (size_t)size;
+    if (in)
+        fclose(in);
+
+    char *from = lcc_depfile_escape(translation);
+    char *to   = lcc_depfile_escape(file);
+    FILE *out  = read && from && to ? fopen(depfile, "wb") : NULL;
+    bool  success = out;
+    if (out) {
+        size_t length     = size;
+        size_t fromlength = strlen(from);
+        size_t written    = 0;
+        for (size_t i = 0; success && i + fromlength <= length; i++) {
+            if (memcmp(data + i, from, fromlength))
+                continue;
+            bool begins = !i || ((data[i - 1] == ' ' || data[i - 1] == '\t' || data[i - 1] == '\n')
+                                 && !(i > 1 && data[i - 1] == ' ' && data[i - 2] == '\\'));
+            if (!begins || !lcc_depfile_separator(data, length, i + fromlength))
+                continue;
+            success = fwrite(data + written, 1, i - written, out) == i - written && fputs(to, out) >= 0;
+            written = i + fromlength;
+            i       = written - 1;
+        }
+        success = success && fwrite(data + written, 1, length - written, out) == length - written;
+        success = !fclose(out) && success;
     }
-    return false;
+    free(data);
+    free(from);
+    free(to);
+    return success;
+}
+
+/* Writes the translation to current->translation, then compiles that file with
+ * its source's directory searched for quoted includes, before any other.
+ * The translation is written to a temporary file first and renamed, so that a
+ * compiler never reads a half written one. The source is NULL when ppargs
+ * runs an external lambda-pp.
+ */
+static int lcc_compile_translation(const lcc_build_t *build, char **ccargs, size_t input, lcc_source_t *current,
+                                   char **ppargs, lambda_source_t *source)
+{
+    const char *translation = current->translation;
+    size_t      length      = strlen(translation);
+    char       *temporary   = malloc(length + sizeof(".XXXXXX"));
+    int         fd          = -1;
+
+    if (temporary) {
+        memcpy(temporary, translation, length);
+        strcpy(temporary + length, ".XXXXXX");
+        if ((fd = mkstemp(temporary)) < 0)
+            lcc_error("Couldn't create %s: %s", temporary, strerror(errno));
+    } else {
+        lcc_error("Out of memory");
+    }
+    if (fd < 0) {
+        if (source)
+            parse_close(source);
+        free(temporary);
+        return 1;
+    }
+
+    current->translate.begin = lambda_clock();
+    pid_t pp;
+    bool  translated = source ? lcc_translate(source, fd)
+                              : lcc_spawn(&pp, ppargs, -1, fd, -1) && !lcc_wait(pp);
+    if (!source)
+        close(fd);
+    lcc_span_end(&current->translate);
+    if (translated && rename(temporary, translation)) {
+        lcc_error("Couldn't write %s: %s", translation, strerror(errno));
+        translated = false;
+    }
+    if (!translated)
+        unlink(temporary);
+    free(temporary);
+    if (!translated)
+        return 1;
+
+    const char *file  = current->file;
+    const char *slash = strrchr(file, '/');
+    char       *dir   = slash ? strndup(file, slash == file ? 1 : (size_t)(slash - file)) : strdup(".");
+    lcc_args_t  args;
+    int         status = 1;
+    if (!dir || !lcc_args_init(&args)) {
+        lcc_error("Out of memory");
+        free(dir);
+        return 1;
+    }
+    bool success = true;
+    for (size_t i = 0; success && ccargs[i]; i++) {
+        if (i == build->words)
+            success = lcc_args_push(&args, "-iquote") && lcc_args_push(&args, dir);
+        success = success && lcc_args_push(&args, i == input ? (char *)translation : ccargs[i]);
+    }
+    if (success) {
+        pid_t compiler;
+        current->spawn.begin = current->compile.begin = lambda_clock();
+        bool started = lcc_spawn(&compiler, args.data, -1, -1, -1);
+        lcc_span_end(&current->spawn);
+        status = started ? lcc_wait(compiler) : 1;
+        lcc_span_end(&current->compile);
+        if (!status && current->depfile && !lcc_depfile_rewrite(current->depfile, translation, file)) {
+            lcc_error("Couldn't rewrite %s: %s", current->depfile, strerror(errno));
+            status = 1;
+        }
+    } else {
+        lcc_error("Out of memory");
+    }
+    lcc_args_destroy(&args);
+    free(dir);
+    return status;
+}
+#endif
+
+/* Translates the source and compiles it with the arguments in ccargs, which
+ * have the compiler read the source from stdin, ccargs[input] being the "-".
+ * The timings are recorded in current.
+ */
+static int lcc_compile(const lcc_build_t *build, char **ccargs, size_t input, lcc_source_t *current) {
+    const char *file = current->file;
+    lcc_args_t  ppargs;
+    int         status = 1;
+    if (!lcc_args_init(&ppargs)) {
+        lcc_error("Out of memory");
+        return 1;
+    }
+    if (build->lambdapp) {
+        if (!lcc_args_push(&ppargs, build->lambdapp)
+            || (build->server && (!lcc_args_push(&ppargs, "--client") || !lcc_args_push(&ppargs, (char *)build->server)))
+            || (build->stable && !lcc_args_push(&ppargs, "--stable-names"))
+            || (build->dedupe && !lcc_args_push(&ppargs, "--dedupe"))
+            || (build->inlined && !lcc_args_push(&ppargs, "--inline"))
+            || (build->cxx && current->cpp && !lcc_args_push(&ppargs, "--cxx"))
+            || (build->markers && !lcc_args_push(&ppargs, (char *)build->markers))
+            || (build->stats && !lcc_args_push(&ppargs, "--stats"))
+            || !lcc_args_push(&ppargs, "--stream") || !lcc_args_push(&ppargs, (char *)file))
+        {
+            lcc_error("Out of memory");
+            goto compile_done;
+        }
+    }
+
+#ifndef _NDEBUG
+    lambda_source_t source;
+    if (!build->lambdapp) {
+        lambda_source_init(&source);
+        lambda_source_prepare(&source);
+        source.file         = file;
+        source.cache        = build->cache;
+        source.stable_names = build->stable;
+        source.dedupe       = build->dedupe;
+        source.inline_all   = build->inlined;
+        source.cxx          = build->cxx && current->cpp;
+        source.jobs         = build->jobs;
+        if (build->markers)
+            lambda_markers_parse(build->markers + 10, &source.markers);
+        if (lcc_reporting(build))
+            source.stats = &current->stats;
+        current->stats.open.begin = lambda_clock();
+        if (!parse_open(&source, open(file, O_RDONLY))) {
+            lcc_error("Couldn't open %s: %s", file, strerror(errno));
+            goto compile_done;
+        }
+        lcc_span_end(&current->stats.open);
+
+        /* without a lambda the compiler can read the file itself */
+        if (lambda_source_plain(&source)) {
+            pid_t compiler;
+            parse_close(&source);
+            ccargs[input] = (char *)file;
+            current->spawn.begin = current->compile.begin = lambda_clock();
+            bool started = lcc_spawn(&compiler, ccargs, -1, -1, -1);
+            lcc_span_end(&current->spawn);
+            status = started ? lcc_wait(compiler) : 1;
+            lcc_span_end(&current->compile);
+            ccargs[input] = "-";
+            goto compile_done;
+        }
+
+        /* a cached translation is read by the compiler straight from the cache */
+        int cached = source.cache && !current->translation ? lambda_cache_open(&source) : -1;
+        if (cached >= 0) {
+            pid_t compiler;
+            parse_close(&source);
+            current->spawn.begin = current->compile.begin = lambda_clock();
+            bool started = lcc_spawn(&compiler, ccargs, cached, -1, -1);
+            lcc_span_end(&current->spawn);
+            close(cached);
+            status = started ? lcc_wait(compiler) : 1;
+            lcc_span_end(&current->compile);
+            goto compile_done;
+        }
+    }
+
+    if (current->translation) {
+        status = lcc_compile_translation(build, ccargs, input, current, ppargs.data, build->lambdapp ? NULL : &source);
+        goto compile_done;
+    }
+
+    /* The translation is written into a pipe which the compiler reads from, a
+     * larger pipe means fewer context switches between the two.
+     */
+    int pipes[2];
+    if (!lcc_pipe(pipes)) {
+        lcc_error("Failed to create a pipe: %s", strerror(errno));
+        if (!build->lambdapp)
+            parse_close(&source);
+        goto compile_done;
+    }
+#ifdef F_SETPIPE_SZ
+    fcntl(pipes[1], F_SETPIPE_SZ, LCC_PIPE_SIZE);
+#endif
+
+    pid_t pp, compiler;
+    bool  external  = build->lambdapp;
+    current->spawn.begin = current->translate.begin = lambda_clock();
+    bool  ppstarted = !external || lcc_spawn(&pp, ppargs.data, -1, pipes[1], pipes[0]);
+    current->compile.begin = lambda_clock();
+    bool  ccstarted = ppstarted && lcc_spawn(&compiler, ccargs, pipes[0], -1, pipes[1]);
+    lcc_span_end(&current->spawn);
+    close(pipes[0]);
+
+    /* A failed translation fails the build even when the compiler happens to
+     * accept what was written up to the error.
+     */
+    int ppstatus = 1;
+    if (external) {
+        close(pipes[1]);
+        if (ppstarted)
+            ppstatus = lcc_wait(pp);
+    } else if (ccstarted) {
+        current->translate.begin = lambda_clock();
+        ppstatus = lcc_translate(&source, pipes[1]) ? 0 : 1;
+    } else {
+        close(pipes[1]);
+        parse_close(&source);
+    }
+    lcc_span_end(&current->translate);
+    status = ccstarted ? lcc_wait(compiler) : 1;
+    lcc_span_end(&current->compile);
+    if (!status)
+        status = ppstatus;
+#else
+    (void)input;
+    if (build->lambdapp)
+        lcc_print(ppargs.data);
+    else
+        printf("<translate %s>", file);
+    printf(" | ");
+    lcc_print(ccargs);
+    printf("\n");
+    status = 0;
+#endif
+
+compile_done:
+    lcc_args_destroy(&ppargs);
+    return status;
+}
+
+/* Compiles one of the sources into its output */
+static int lcc_compile_source(const lcc_build_t *build, lcc_source_t *source, bool link) {
+    lcc_args_t ccargs;
+    int        status = 1;
+    if (!lcc_args_init(&ccargs)) {
+        lcc_error("Out of memory");
+        return 1;
+    }
+    bool success = true;
+    for (size_t i = 0; success && i != build->flags.used; i++)
+        success = lcc_args_push(&ccargs, build->flags.data[i]);
+    if (success && link)
+        success = lcc_args_push(&ccargs, "-c");
+    size_t input = ccargs.used + 2;
+    if (success)
+        success = lcc_args_push(&ccargs, "-x") && lcc_args_push(&ccargs, source->cpp ? "c++" : "c")
+               && lcc_args_push(&ccargs, "-") && lcc_args_push(&ccargs, "-x") && lcc_args_push(&ccargs, "none")
+               && lcc_args_push(&ccargs, "-o") && lcc_args_push(&ccargs, source->output);
+    if (success)
+        status = lcc_compile(build, ccargs.data, input, source);
+    else
+        lcc_error("Out of memory");
+    lcc_args_destroy(&ccargs);
+    return status;
+}
+
+typedef struct {
+    lcc_build_t *build;
+    bool         link;
+} lcc_worker_t;
+
+static void *lcc_worker(void *argument) {
+    lcc_worker_t *worker = argument;
+    lcc_build_t  *build  = worker->build;
+
+    pthread_mutex_lock(&build->mutex);
+    unsigned tid = build->workers++;
+    pthread_mutex_unlock(&build->mutex);
+    while (true) {
+        pthread_mutex_lock(&build->mutex);
+        size_t next = build->next < build->count ? build->next++ : build->count;
+        pthread_mutex_unlock(&build->mutex);
+        if (next == build->count)
+            break;
+        build->sources[next].tid = tid;
+        int status = lcc_compile_source(build, &build->sources[next], worker->link);
+        if (status) {
+            pthread_mutex_lock(&build->mutex);
+            if (!build->status)
+                build->status = status;
+            pthread_mutex_unlock(&build->mutex);
+        }
+    }
+    return NULL;
+}
+
+/* Compiles all of the sources on up to jobs threads */
+static int lcc_compile_all(lcc_build_t *build, size_t jobs, bool link) {
+    lcc_worker_t worker = { build, link };
+    pthread_t   *threads = NULL;
+    size_t       started = 0;
+
+    if (jobs > build->count)
+        jobs = build->count;
+    if (jobs > 1 && !(threads = malloc(sizeof(*threads) * (jobs - 1))))
+        jobs = 1;
+
+    pthread_mutex_init(&build->mutex, NULL);
+    for (; started + 1 < jobs; ++started) {
+        if (pthread_create(&threads[started], NULL, &lcc_worker, &worker))
+            break;
+    }
+    lcc_worker(&worker);
+    while (started--)
+        pthread_join(threads[started], NULL);
+    pthread_mutex_destroy(&build->mutex);
+    free(threads);
+    return build->status;
+}
+
+static int lcc_run(char **argv) {
+#ifndef _NDEBUG
+    pid_t pid;
+    return lcc_spawn(&pid, argv, -1, -1, -1) ? lcc_wait(pid) : 1;
+#else
+    lcc_print(argv);
+    printf("\n");
+    return 0;
+#endif
 }
 
 int main(int argc, char **argv) {
@@ -215,112 +928,268 @@ int main(int argc, char **argv) {
         return 1;
     }
 
+    lambda_span_t total, discovery, link = { 0, 0 };
+    total.begin = discovery.begin = lambda_clock();
     const char *cc = lcc_compiler_find();
     if (!cc) {
         lcc_error("Couldn't find a compiler");
         return 1;
     }
+    lcc_span_end(&discovery);
 
-    const char *lambdapp = lcc_lambdapp_find();
-    if (!lambdapp) {
-        lcc_error("Couldn't find lambda-pp");
-        return 1;
-    }
-
-    /* Get the arguments */
-    lcc_string_t args_before; /* before -o */
-    lcc_string_t args_after;  /* after -o */
-    if (!lcc_string_init(&args_before)) {
+    int            status = 1;
+    char          *ccwords = NULL;
+    size_t         input   = 0;
+    lcc_args_t     ccargs;
+    lcc_build_t    build = { .status = 0, .json = -1 };
+    lambda_trace_t tracer;
+    const char    *trace = NULL;
+    if (!lcc_args_init(&ccargs)) {
         lcc_error("Out of memory");
         return 1;
     }
-    if (!lcc_string_init(&args_after)) {
+    if (!lcc_args_init(&build.flags)) {
         lcc_error("Out of memory");
-        lcc_string_destroy(&args_before);
+        lcc_args_destroy(&ccargs);
         return 1;
     }
-    
-    /* Find the source file */
-    lcc_source_t source;
-    if (!lcc_source_find(argc, argv, &source)) {
-        /* If there isn't any source file on the command line it means
-         * the compiler is being used to invoke the linker.
-         */
-        lcc_string_destroy(&args_after);
-        lcc_string_appendf(&args_before, "%s", cc);
-        for (int i = 0; i < argc; i++) {
-            if (!lcc_string_appendf(&args_before, " %s", argv[i]))
-                goto args_oom;
-        }
+    if (!(build.sources = calloc(argc, sizeof(*build.sources))))
+        goto args_oom;
+    if (!(ccwords = lcc_args_command(&ccargs, cc)))
+        goto args_oom;
+    for (size_t i = 0; i != ccargs.used; i++) {
+        if (!lcc_args_push(&build.flags, ccargs.data[i]))
+            goto args_oom;
+    }
+    build.words = ccargs.used;
 
-        int attempt = system(args_before.buffer);
-        lcc_string_destroy(&args_before);
-        return attempt;
+    /* Find the sources, the output and what is being asked for */
+    const char *output  = NULL;
+    const char *ext     = NULL; /* of the outputs when not linking */
+    const char *depfile = NULL; /* -MF */
+    bool        deps    = false;
+    size_t      jobs    = 0;
+    for (int i = 0; i < argc; i++) {
+        lcc_source_t *source = &build.sources[build.count];
+        if (!strcmp(argv[i], "-c"))
+            ext = ".o";
+        else if (!strcmp(argv[i], "-S"))
+            ext = ".s";
+        else if (!strcmp(argv[i], "-E"))
+            ext = "";
+        else if (!strncmp(argv[i], "-j", 2)) {
+            const char *value = argv[i][2] ? argv[i] + 2 : i + 1 < argc ? argv[i + 1] : "";
+            char       *end;
+            jobs = strtoul(value, &end, 10);
+            if (*end || !jobs) {
+                lcc_error("Invalid number of jobs: %s", value);
+                goto done;
+            }
+        } else if (!strcmp(argv[i], "--stable-names"))
+            build.stable = true;
+        else if (!strcmp(argv[i], "--dedupe"))
+            build.dedupe = true;
+        else if (!strcmp(argv[i], "--inline"))
+            build.inlined = true;
+        else if (!strcmp(argv[i], "--cxx"))
+            build.cxx = true;
+        else if (!strcmp(argv[i], "--lpp-files"))
+            build.files = true;
+        else if (!strcmp(argv[i], "-MD") || !strcmp(argv[i], "-MMD"))
+            deps = true;
+        else if (!strncmp(argv[i], "-MF", 3) && (argv[i][3] || i + 1 < argc))
+            depfile = argv[i][3] ? argv[i] + 3 : argv[i + 1];
+        else if (!strncmp(argv[i], "--markers=", 10)) {
+            lambda_markers_t markers;
+            if (!lambda_markers_parse(argv[i] + 10, &markers)) {
+                lcc_error("Invalid marker mode: %s", argv[i] + 10);
+                goto done;
+            }
+            build.markers = argv[i];
+        } else if (!strcmp(argv[i], "--stats"))
+            build.stats = true;
+        else if (!strncmp(argv[i], "--stats=", 8)) {
+            if (build.json >= 0)
+                close(build.json);
+            if ((build.json = open(argv[i] + 8, O_WRONLY | O_CREAT | O_APPEND, 0666)) < 0) {
+                lcc_error("Couldn't open %s: %s", argv[i] + 8, strerror(errno));
+                goto done;
+            }
+        } else if (!strncmp(argv[i], "--trace=", 8))
+            trace = argv[i] + 8;
+        else if (!strcmp(argv[i], "-o") && i + 1 < argc)
+            output = argv[i + 1];
+        else if (lcc_source_is(argv[i], &source->cpp)) {
+            source->file  = argv[i];
+            source->index = i;
+            build.count++;
+        }
+        if (lcc_option_value(argv[i]))
+            i++;
     }
 
-    /* Find the output file */
-    lcc_output_t output = { .aout = false };
-    if (!lcc_output_find(argc, argv, &output)) {
-        /* not found? default to a.out */
-        output.output = "a.out";
-        output.aout = true;
+    /* The translation happens in-process unless LAMBDA_PP asks for an external
+     * lambda-pp, or there is a running lambda-pp server to hand it to.
+     */
+    build.cache  = getenv("LAMBDAPP_CACHE_DIR");
+    if (build.cache && !*build.cache)
+        build.cache = NULL;
+    build.server = getenv("LAMBDA_PP_SERVER");
+    if (build.server && !*build.server)
+        build.server = NULL;
+    const char *external = getenv("LAMBDA_PP");
+    if (trace) {
+        lambda_trace_init(&tracer);
+        build.trace = &tracer;
     }
-    
-    /* Stop at the -o */
-    size_t stop = output.aout ? (size_t)argc : output.index;
-    for (size_t i = 0; i < stop; i++) {
-        /* Ignore the source file */
-        if (i == source.index)
-            continue;
-        if (!lcc_string_appendf(&args_before, "%s ", argv[i]))
+    if (build.count && ((external && *external) || build.server)) {
+        uint64_t    begin    = lambda_clock();
+        const char *lambdapp = lcc_lambdapp_find(argv[-1]);
+        discovery.duration  += lambda_clock() - begin;
+        if (!lambdapp) {
+            lcc_error("Couldn't find lambda-pp");
+            goto done;
+        }
+        if (!(build.lambdapp = malloc(strlen(lambdapp) + sizeof("/lambda-pp"))))
             goto args_oom;
+        strcpy(build.lambdapp, lambdapp);
+        strcat(build.lambdapp, "/lambda-pp");
     }
-    /* Trim the trailing whitespace */
-    if (args_before.used >= 2)
-        args_before.buffer[args_before.used - 2] = '\0';
-    
-    /* Handle anythng after the -o */
-    stop += 2; /* skip -o and <output> */
-    size_t count = argc;
-    if (stop != count) {
-        for (size_t i = stop; i < count; i++) {
-            if (!lcc_string_appendf(&args_after, "%s ", argv[i]))
+
+    /* A single source goes through the compiler as it is, with the source
+     * read from stdin. Sources are compiled first when there are more of them,
+     * then the objects get linked like the sources would have been.
+     */
+    size_t       source = 0;
+    bool         single = build.count == 1;
+    lcc_source_t *first = build.sources;
+    if (single && !output && ext && *ext && !(first->output = lcc_output_name(first->file, ext)))
+        goto args_oom;
+    if (build.count > 1 && !ext) {
+        for (size_t s = 0; s != build.count; s++) {
+            if (!(build.sources[s].output = lcc_output_temporary())) {
+                lcc_error("Failed to create a temporary file: %s", strerror(errno));
+                goto done;
+            }
+            build.sources[s].temporary = true;
+        }
+    } else if (build.count > 1) {
+        if (!*ext || output) {
+            lcc_error("Can't use %s with multiple sources", output ? "-o" : "-E");
+            goto done;
+        }
+        for (size_t s = 0; s != build.count; s++) {
+            if (!(build.sources[s].output = lcc_output_name(build.sources[s].file, ext)))
                 goto args_oom;
         }
     }
-    /* Trim trailing whitespace */
-    if (args_after.used >= 2)
-        args_after.buffer[args_after.used - 2] = '\0';
 
-    /* Build the shell call */
-    lcc_string_t shell;
-    if (!lcc_string_init(&shell))
-        goto args_oom;
+    /* With --lpp-files the translation of build/foo.o is written to
+     * build/foo.lpp.c, and the dependency file the compiler writes for it
+     * is rewritten to name the source instead. Sources which are linked right
+     * away and -E still go through a pipe.
+     */
+    for (size_t s = 0; build.files && ext && *ext && s != build.count; s++) {
+        lcc_source_t *current = &build.sources[s];
+        const char   *object  = single && output ? output : current->output;
+        char          suffix[16];
+        snprintf(suffix, sizeof(suffix), ".lpp%s", strrchr(current->file, '.'));
+        if (!(current->translation = lcc_output_sibling(object, suffix)))
+            goto args_oom;
+        if (deps && !(current->depfile = depfile ? strdup(depfile) : lcc_output_sibling(object, ".d")))
+            goto args_oom;
+    }
 
-    const char *lang = source.cpp ? "c++" : "c";
-    if (!lcc_string_appendf(&shell, "%s/lambda-pp %s | %s -x%s %s - -o %s %s",
-        lambdapp, source.file, cc, lang, args_before.buffer, output.output, args_after.buffer))
-            goto shell_oom;
+    for (int i = 0; i < argc; i++) {
+        bool value = lcc_option_value(argv[i]) && i + 1 < argc;
+        if (!strncmp(argv[i], "-j", 2)) {
+            i += !argv[i][2];
+            continue;
+        }
+        if (!strcmp(argv[i], "--stable-names") || !strcmp(argv[i], "--dedupe") || !strcmp(argv[i], "--inline")
+            || !strcmp(argv[i], "--cxx") || !strcmp(argv[i], "--lpp-files") || !strncmp(argv[i], "--markers=", 10) || !strcmp(argv[i], "--stats") || !strncmp(argv[i], "--stats=", 8) || !strncmp(argv[i], "--trace=", 8))
+            continue;
+        if (source != build.count && (size_t)i == build.sources[source].index) {
+            lcc_source_t *current = &build.sources[source++];
+            input = ccargs.used + 2;
+            bool pushed = single
+                ? lcc_args_push(&ccargs, "-x") && lcc_args_push(&ccargs, current->cpp ? "c++" : "c")
+                  && lcc_args_push(&ccargs, "-") && lcc_args_push(&ccargs, "-x") && lcc_args_push(&ccargs, "none")
+                  && (!current->output || (lcc_args_push(&ccargs, "-o") && lcc_args_push(&ccargs, current->output)))
+                : !current->temporary || lcc_args_push(&ccargs, current->output);
+            if (!pushed)
+                goto args_oom;
+            continue;
+        }
+        if (!lcc_args_push(&ccargs, argv[i]) || (value && !lcc_args_push(&ccargs, argv[i + 1])))
+            goto args_oom;
 
-    int attempt = 0;
-#ifndef _NDEBUG
-    /* Call the shell */
-    attempt = system(shell.buffer);
-#else
-    printf("%s\n", shell.buffer);
-#endif
+        /* what every compile of multiple sources gets */
+        bool skip = !strcmp(argv[i], "-o") || (!ext && lcc_link_only(argv[i]));
+        if (!skip && (!lcc_args_push(&build.flags, argv[i]) || (value && !lcc_args_push(&build.flags, argv[i + 1]))))
+            goto args_oom;
+        i += value;
+    }
 
-    lcc_string_destroy(&shell);
-    lcc_string_destroy(&args_before);
-    lcc_string_destroy(&args_after);
+    /* a compiler which exits early shows as a failed write instead */
+    signal(SIGPIPE, SIG_IGN);
 
-    return attempt;
+    if (!build.count) {
+        /* If there isn't any source file on the command line it means
+         * the compiler is being used to invoke the linker.
+         */
+        status = lcc_run(ccargs.data);
+    } else if (single) {
+        build.jobs = jobs;
+        status = lcc_compile(&build, ccargs.data, input, first);
+    } else {
+        if (!jobs) {
+            long online = sysconf(_SC_NPROCESSORS_ONLN);
+            jobs = online > 0 ? (size_t)online : 1;
+        }
+        status = lcc_compile_all(&build, jobs, !ext);
+        if (!status && !ext) {
+            link.begin = lambda_clock();
+            status = lcc_run(ccargs.data);
+            lcc_span_end(&link);
+        }
+    }
+
+    if (lcc_reporting(&build)) {
+        for (size_t s = 0; s != build.count; s++)
+            lcc_report_source(&build, &build.sources[s]);
+        lcc_report_step(&build, "discovery", &discovery);
+        if (link.begin)
+            lcc_report_step(&build, "link", &link);
+        lcc_span_end(&total);
+        lcc_report_step(&build, "total", &total);
+    }
+
+done:
+    if (build.trace) {
+        if (!lambda_trace_write(build.trace, trace)) {
+            lcc_error("Failed to write the trace to %s: %s", trace, strerror(errno));
+            status = 1;
+        }
+        lambda_trace_destroy(build.trace);
+    }
+    if (build.json >= 0)
+        close(build.json);
+    for (size_t s = 0; s != build.count; s++) {
+        if (build.sources[s].temporary)
+            unlink(build.sources[s].output);
+        free(build.sources[s].output);
+        free(build.sources[s].translation);
+        free(build.sources[s].depfile);
+    }
+    free(build.sources);
+    free(build.lambdapp);
+    free(ccwords);
+    lcc_args_destroy(&build.flags);
+    lcc_args_destroy(&ccargs);
+    return status;
 
-shell_oom:
-    lcc_string_destroy(&shell);
 args_oom:
     lcc_error("Out of memory");
-    lcc_string_destroy(&args_before);
-    lcc_string_destroy(&args_after);
-    return 1;
+    goto done;
 }
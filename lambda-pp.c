@@ -23,530 +23,1462 @@
 */
 #include <stdlib.h>
 #include <string.h>
-#include <stdarg.h>
 #include <stdio.h>
 #include <errno.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <dirent.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#include "lambdapp-internal.h"
+
+/* Where the statistics of each translation go */
+typedef struct {
+    bool            print; /* to stderr */
+    int             json;  /* appended as JSON lines, -1 for none */
+    lambda_trace_t *trace; /* or NULL */
+} lambda_report_t;
 
-#define isalpha(a) ((((unsigned)(a)|32)-'a') < 26)
-#define isdigit(a) (((unsigned)(a)-'0') < 10)
-#define isalnum(a) (isalpha(a) || isdigit(a))
-#define isspace(a) (((a) >= '\t' && (a) <= '\r') || (a) == ' ')
-
-static const char *DefaultKeyword = "lambda";
+static bool report_enabled(const lambda_report_t *report) {
+    return report->print || report->json >= 0 || report->trace;
+}
 
-typedef struct {
-    size_t begin;
-    size_t length;
-} lambda_range_t;
+static void report_stats(const lambda_report_t *report, const char *file, const lambda_stats_t *stats, unsigned tid) {
+    if (report->print)
+        lambda_stats_print(STDERR_FILENO, file, stats);
+    if (report->json >= 0 && !lambda_stats_json(report->json, file, stats))
+        fprintf(stderr, "%s: failed to write the statistics\n", file);
+    if (report->trace) {
+        lambda_trace_event(report->trace, "open", file, &stats->open, tid);
+        lambda_trace_event(report->trace, "generate", file, &stats->generate, tid);
+        if (stats->parse.duration)
+            lambda_trace_event(report->trace, "parse", file, &stats->parse, tid);
+    }
+}
 
-typedef struct {
-    size_t pos;
-    size_t line;
-} lambda_position_t;
+/* Translates one file with the options in the template source, output is
+ * the file to write to or NULL for outfile. Statistics are reported for the
+ * thread tid.
+ */
+static bool translate(const lambda_source_t *options, const char *file, const char *output, int outfile,
+                      lambda_arena_t *arena, lambda_output_t *out, bool stream,
+                      const lambda_report_t *report, unsigned tid)
+{
+    lambda_source_t source = *options;
+    lambda_stats_t  stats;
+
+    memset(&stats, 0, sizeof(stats));
+    if (report_enabled(report))
+        source.stats = &stats;
+    source.file = file ? file : "<stdin>";
+    stats.open.begin = lambda_clock();
+    if (!parse_open(&source, file ? open(file, O_RDONLY) : STDIN_FILENO)) {
+        fprintf(stderr, "failed to open file %s %s\n", source.file, strerror(errno));
+        return false;
+    }
+    stats.open.duration = lambda_clock() - stats.open.begin;
 
-typedef struct {
-    const char *file;
-    char       *data;
-    size_t      length;
-    size_t      line;
-    const char *keyword;
-    size_t      keylength;
-    bool        short_enabled;
-} lambda_source_t;
+    if (output) {
+        outfile = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (outfile < 0) {
+            fprintf(stderr, "failed to open file %s: %s\n", output, strerror(errno));
+            parse_close(&source);
+            return false;
+        }
+    }
+    output_init(out, outfile);
+    bool success = generate(out, &source, arena, stream);
+    if (output)
+      close(outfile);
+    parse_close(&source);
 
-typedef struct {
-    size_t         start;
-    lambda_range_t decl;
-    lambda_range_t body;
-    size_t         name_offset;
-    size_t         decl_line;
-    size_t         body_line;
-    size_t         end_line;
-    bool           is_short;
-} lambda_t;
+    if (source.stats)
+        report_stats(report, source.file, &stats, tid);
+    arena->peak = 0;
+    return success;
+}
 
+/* Batch mode */
 typedef struct {
-    union {
-        char              *chars;
-        lambda_t          *funcs;
-        lambda_position_t *positions;
-    };
-    size_t size;
-    size_t elements;
-    size_t length;
-} lambda_vector_t;
+    const lambda_source_t *options;
+    const char           **files;
+    char                 **outputs; /* of each of the files */
+    size_t                 count;
+    const char            *outdir;
+    bool                   stream;
+    const lambda_report_t *report;
+    pthread_mutex_t        mutex;
+    size_t                 next;   /* the next file to translate */
+    unsigned               workers;
+    bool                   failed;
+} lambda_batch_t;
+
+/* The output has the name of the input in the output directory, with the .l
+ * taken out of names like foo.l.c
+ */
+static char *batch_output(const char *outdir, const char *file) {
+    const char *name = strrchr(file, '/');
+    name = name ? name + 1 : file;
+
+    size_t      dirlength = strlen(outdir);
+    size_t      length    = strlen(name);
+    const char *ext       = strrchr(name, '.');
+    size_t      drop      = 0;
+    if (ext && ext - name >= 2 && !strncmp(ext - 2, ".l", 2))
+        drop = 2;
+
+    char *output = (char *)malloc(dirlength + length + 2);
+    if (!output)
+        return NULL;
+    memcpy(output, outdir, dirlength);
+    if (dirlength && outdir[dirlength-1] != '/')
+        output[dirlength++] = '/';
+    if (drop) {
+        memcpy(output + dirlength, name, ext - 2 - name);
+        strcpy(output + dirlength + (ext - 2 - name), ext);
+    } else
+        strcpy(output + dirlength, name);
+    return output;
+}
 
-typedef struct {
-  lambda_vector_t lambdas;
-  lambda_vector_t positions;
-} parse_data_t;
+static bool batch_file(lambda_batch_t *batch, size_t f, lambda_arena_t *arena, lambda_output_t *out, unsigned tid) {
+    const char *file   = batch->files[f];
+    const char *output = batch->outputs[f];
+    struct stat in, existing;
+    if (!stat(file, &in) && !stat(output, &existing) && in.st_dev == existing.st_dev && in.st_ino == existing.st_ino) {
+        fprintf(stderr, "%s: refusing to overwrite the input with its translation\n", file);
+        return false;
+    }
+    return translate(batch->options, file, output, -1, arena, out, batch->stream, batch->report, tid);
+}
 
-typedef enum {
-    PARSE_NORMAL, PARSE_TYPE, PARSE_LAMBDA, PARSE_LAMBDA_EXPRESSION
-} parse_type_t;
+static const lambda_batch_t *batch_sorting;
 
-static size_t parse(lambda_source_t *source, parse_data_t *data, size_t j, parse_type_t parsetype, size_t *nameofs);
+static int batch_compare(const void *a, const void *b) {
+    return strcmp(batch_sorting->outputs[*(const size_t *)a], batch_sorting->outputs[*(const size_t *)b]);
+}
 
-/* Vector */
-static inline bool lambda_vector_init(lambda_vector_t *vec, size_t size) {
-    vec->length   = 32;
-    vec->size     = size;
-    vec->elements = 0;
-    return (vec->chars = (char *)malloc(vec->length * vec->size));
+/* The outputs only have the names of the inputs, files with the same name
+ * from different directories would overwrite each other's translation.
+ */
+static bool batch_outputs(lambda_batch_t *batch) {
+    size_t *order = (size_t *)malloc(sizeof(*order) * batch->count);
+    if (!order || !(batch->outputs = (char **)calloc(batch->count, sizeof(*batch->outputs)))) {
+        fprintf(stderr, "out of memory\n");
+        free(order);
+        return false;
+    }
+    for (size_t f = 0; f != batch->count; ++f) {
+        if (!(batch->outputs[f] = batch_output(batch->outdir, batch->files[f]))) {
+            fprintf(stderr, "%s: out of memory\n", batch->files[f]);
+            free(order);
+            return false;
+        }
+        order[f] = f;
+    }
+    batch_sorting = batch;
+    qsort(order, batch->count, sizeof(*order), &batch_compare);
+    bool unique = true;
+    for (size_t f = 1; f < batch->count; ++f) {
+        if (!strcmp(batch->outputs[order[f-1]], batch->outputs[order[f]])) {
+            fprintf(stderr, "%s and %s would both be translated to %s\n",
+                    batch->files[order[f-1]], batch->files[order[f]], batch->outputs[order[f]]);
+            unique = false;
+        }
+    }
+    free(order);
+    return unique;
 }
 
-static inline void lambda_vector_destroy(lambda_vector_t *vec) {
-    free(vec->chars);
+/* Every worker owns its arena and output buffer and takes the next file until
+ * there are none left.
+ */
+static void *batch_worker(void *argument) {
+    lambda_batch_t  *batch = (lambda_batch_t *)argument;
+    lambda_output_t *out   = output_create();
+    lambda_arena_t   arena;
+    bool             failed = !out;
+
+    pthread_mutex_lock(&batch->mutex);
+    unsigned tid = batch->workers++;
+    pthread_mutex_unlock(&batch->mutex);
+
+    lambda_arena_init(&arena);
+    while (out) {
+        pthread_mutex_lock(&batch->mutex);
+        size_t next = batch->next < batch->count ? batch->next++ : batch->count;
+        pthread_mutex_unlock(&batch->mutex);
+        if (next == batch->count)
+            break;
+        if (!batch_file(batch, next, &arena, out, tid))
+            failed = true;
+    }
+    lambda_arena_destroy(&arena);
+    output_destroy(out);
+
+    if (failed) {
+        pthread_mutex_lock(&batch->mutex);
+        batch->failed = true;
+        pthread_mutex_unlock(&batch->mutex);
+    }
+    return NULL;
 }
 
-static inline bool lambda_vector_resize(lambda_vector_t *vec) {
-    if (vec->elements != vec->length)
-        return true;
-    vec->length <<= 1;
-    char *temp = realloc(vec->chars, vec->length * vec->size);
-    if (!temp)
+static bool batch_run(lambda_batch_t *batch, size_t jobs) {
+    pthread_t *threads = NULL;
+    size_t     started = 0;
+
+    if (!batch_outputs(batch)) {
+        for (size_t f = 0; batch->outputs && f != batch->count; ++f)
+            free(batch->outputs[f]);
+        free(batch->outputs);
         return false;
-    vec->chars = temp;
-    return true;
+    }
+
+    if (jobs > batch->count)
+        jobs = batch->count;
+    if (jobs > 1 && !(threads = (pthread_t *)malloc(sizeof(*threads) * (jobs - 1))))
+        jobs = 1;
+
+    pthread_mutex_init(&batch->mutex, NULL);
+    for (; started + 1 < jobs; ++started) {
+        if (pthread_create(&threads[started], NULL, &batch_worker, batch))
+            break;
+    }
+    /* the main thread is a worker too */
+    batch_worker(batch);
+    while (started--)
+        pthread_join(threads[started], NULL);
+    pthread_mutex_destroy(&batch->mutex);
+
+    for (size_t f = 0; f != batch->count; ++f)
+        free(batch->outputs[f]);
+    free(batch->outputs);
+    free(threads);
+    return !batch->failed;
 }
 
-static inline bool lambda_vector_push_char(lambda_vector_t *vec, char ch) {
-    if (!lambda_vector_resize(vec))
-        return false;
-    vec->chars[vec->elements++] = ch;
-    return true;
+/* Unity mode: all of the files are translated one after another into a
+ * single output, each behind its own line markers and with its lambdas
+ * named after its path. Files whose paths give the same prefix get a number
+ * appended to it.
+ */
+static bool unity_run(const lambda_source_t *options, char **files, size_t count, const char *output,
+                      bool stream, const lambda_report_t *report)
+{
+    lambda_output_t *out      = output_create();
+    char           **prefixes = (char **)calloc(count, sizeof(*prefixes));
+    int              outfile  = STDOUT_FILENO;
+    bool             success  = false;
+    lambda_arena_t   arena;
+    struct stat      st;
+
+    lambda_arena_init(&arena);
+    if (!out || !prefixes) {
+        fprintf(stderr, "out of memory\n");
+        goto unity_done;
+    }
+    for (size_t f = 0; f != count; ++f) {
+        char  *prefix = lambda_prefix(files[f]);
+        size_t length = prefix ? strlen(prefix) : 0;
+        for (size_t same = 1, p = 0; prefix && p != f; ++p) {
+            if (strcmp(prefixes[p], prefix))
+                continue;
+            char *numbered = (char *)realloc(prefix, length + 24);
+            if (!numbered) {
+                free(prefix);
+                prefix = NULL;
+                break;
+            }
+            prefix = numbered;
+            snprintf(prefix + length, 24, "_%zu", ++same);
+            p = (size_t)-1; /* all of them again */
+        }
+        if (!(prefixes[f] = prefix)) {
+            fprintf(stderr, "out of memory\n");
+            goto unity_done;
+        }
+    }
+
+    if (output) {
+        for (size_t f = 0; f != count; ++f) {
+            struct stat in;
+            if (!stat(files[f], &in) && !stat(output, &st) && in.st_dev == st.st_dev && in.st_ino == st.st_ino) {
+                fprintf(stderr, "%s: refusing to overwrite the input with the translation\n", files[f]);
+                goto unity_done;
+            }
+        }
+        if ((outfile = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0) {
+            fprintf(stderr, "failed to open file %s: %s\n", output, strerror(errno));
+            goto unity_done;
+        }
+    }
+
+    success = true;
+    for (size_t f = 0; success && f != count; ++f) {
+        lambda_source_t source = *options;
+        source.prefix = prefixes[f];
+        success = translate(&source, files[f], NULL, outfile, &arena, out, stream, report, 0);
+    }
+    if (output)
+        close(outfile);
+
+unity_done:
+    for (size_t f = 0; prefixes && f != count; ++f)
+        free(prefixes[f]);
+    free(prefixes);
+    lambda_arena_destroy(&arena);
+    output_destroy(out);
+    return success;
 }
 
-static inline bool lambda_vector_create_lambda(lambda_vector_t *vec, size_t *idx) {
-    if (!lambda_vector_resize(vec))
+/* Response files list one input per line */
+static bool batch_response(const char *file, char ***files, size_t *count, size_t *allocated) {
+    lambda_source_t list;
+    lambda_source_init(&list);
+    list.file = file;
+    if (!parse_open(&list, open(file, O_RDONLY)))
         return false;
-    *idx = vec->elements++;
-    memset(&vec->funcs[*idx], 0, sizeof(lambda_t));
-    return true;
-}
 
-static inline bool lambda_vector_push_position(lambda_vector_t *vec, size_t pos, size_t line) {
-    if (!lambda_vector_resize(vec))
+    /* the list is kept for the lifetime of the program */
+    char *data = (char *)malloc(list.length + 1);
+    if (!data) {
+        parse_close(&list);
         return false;
-    vec->positions[vec->elements].pos  = pos;
-    vec->positions[vec->elements].line = line;
-    vec->elements++;
+    }
+    memcpy(data, list.data, list.length);
+    data[list.length] = '\0';
+    parse_close(&list);
+
+    for (char *line = data; *line; ) {
+        char *end  = strchr(line, '\n');
+        char *next = end ? end + 1 : line + strlen(line);
+        if (!end)
+            end = next;
+        while (end != line && (end[-1] == '\r' || end[-1] == ' ' || end[-1] == '\t'))
+            --end;
+        *end = '\0';
+        if (*line) {
+            if (*count == *allocated) {
+                size_t request = *allocated ? *allocated * 2 : 16;
+                char **temp = (char **)realloc(*files, request * sizeof(*temp));
+                if (!temp)
+                    return false;
+                *files = temp;
+                *allocated = request;
+            }
+            (*files)[(*count)++] = line;
+        }
+        line = next;
+    }
     return true;
 }
 
-static inline void lambda_source_init(lambda_source_t *source) {
-    memset(source, 0, sizeof(*source));
-    source->keyword       = DefaultKeyword;
-    source->short_enabled = true;
-}
+/* Watch mode
+ *
+ * The sources in a directory tree are translated into a mirror of it in the
+ * output directory, which is then kept up to date with inotify. A file is
+ * translated again when the key of its content and the options changes, and
+ * its output is only replaced, atomically, when the translation differs from
+ * what is there, so that builds going by modification times only rebuild what
+ * really changed.
+ */
+#ifdef __linux__
+typedef struct {
+    char *path; /* relative to the watched directory */
+    char  key[LAMBDA_CACHE_KEY];
+} lambda_watch_file_t;
+
+typedef struct {
+    int   wd;
+    char *path; /* relative to the watched directory, "" for itself */
+} lambda_watch_dir_t;
 
-/* Source */
-static void parse_error(lambda_source_t *source, const char *message, ...) {
-    char buffer[2048];
-    va_list va;
-    va_start(va, message);
-    vsnprintf(buffer, sizeof(buffer), message, va);
-    va_end(va);
-    fprintf(stderr, "%s:%zu error: %s\n", source->file, source->line, buffer);
-    fflush(stderr);
+typedef struct {
+    const lambda_source_t *options;
+    const char            *root;
+    const char            *outdir;
+    struct stat            out;    /* to skip the mirror when it is in the tree */
+    bool                   stream;
+    const lambda_report_t *report;
+    int                    inotify;
+    lambda_watch_file_t   *files;
+    size_t                 nfiles;
+    size_t                 afiles;
+    lambda_watch_dir_t    *dirs;
+    size_t                 ndirs;
+    size_t                 adirs;
+    lambda_output_t       *output;
+    lambda_arena_t         arena;
+    char                  *data;   /* the translation */
+    size_t                 length;
+    size_t                 size;
+} lambda_watch_t;
+
+#define LAMBDA_WATCH_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE | IN_ONLYDIR)
+
+/* Joins two paths with a slash, an empty one is left out */
+static char *watch_join(const char *a, const char *b) {
+    size_t alength = strlen(a);
+    size_t blength = strlen(b);
+    char  *path    = (char *)malloc(alength + blength + 2);
+    if (!path)
+        return NULL;
+    memcpy(path, a, alength);
+    if (alength && blength && a[alength-1] != '/')
+        path[alength++] = '/';
+    memcpy(path + alength, b, blength + 1);
+    return path;
 }
 
-static bool parse_open(lambda_source_t *source, FILE *handle) {
-    if (!handle)
+/* Hidden files are left alone, which includes the swap files of editors */
+static bool watch_source(const char *name) {
+    static const char *extensions[] = {
+        ".c", ".h", ".cc", ".cpp", ".cxx", ".hh", ".hpp", ".hxx"
+    };
+    const char *ext = strrchr(name, '.');
+    if (*name == '.' || !ext)
         return false;
-
-    source->line = 1;
-
-    if (fseek(handle, 0, SEEK_END) != -1) {
-        source->length = ftell(handle);
-        fseek(handle, 0, SEEK_SET);
-
-        if (!(source->data = (char *)malloc(source->length)))
-            goto parse_open_oom;
-        if (fread(source->data, source->length, 1, handle) != 1)
-            goto parse_open_failed;
-    }
-    else {
-        static const size_t bs = 4096;
-        source->length = 0;
-        if (!(source->data = (char*)malloc(bs)))
-            goto parse_open_oom;
-        while (true) {
-            size_t r = fread(source->data, 1, bs, handle);
-            source->length += r;
-            if (feof(handle))
-                break;
-            if (ferror(handle) && errno != EINTR)
-                goto parse_open_failed;
-            char *temp = (char*)realloc(source->data, source->length + bs);
-            if (!temp)
-                goto parse_open_oom;
-            source->data = temp;
-        }
+    for (size_t e = 0; e != sizeof(extensions) / sizeof(*extensions); ++e) {
+        if (!strcmp(ext, extensions[e]))
+            return true;
     }
+    return false;
+}
 
-    fclose(handle);
+static bool watch_sink(void *user, const char *data, size_t length) {
+    lambda_watch_t *watch = (lambda_watch_t *)user;
+    if (watch->length + length > watch->size) {
+        size_t request = watch->size ? watch->size : 4096;
+        while (request < watch->length + length)
+            request *= 2;
+        char *temp = (char *)realloc(watch->data, request);
+        if (!temp)
+            return false;
+        watch->data = temp;
+        watch->size = request;
+    }
+    memcpy(watch->data + watch->length, data, length);
+    watch->length += length;
     return true;
+}
 
-parse_open_oom:
-    parse_error(source, "out of memory");
-parse_open_failed:
-    free(source->data);
-    fclose(handle);
-    return false;
+/* Whether the file holds exactly the translation */
+static bool watch_same(const lambda_watch_t *watch, const char *path) {
+    struct stat st;
+    char        buffer[16 << 10];
+    int         fd   = open(path, O_RDONLY);
+    bool        same = fd >= 0 && !fstat(fd, &st) && S_ISREG(st.st_mode) && (size_t)st.st_size == watch->length;
+    for (size_t got = 0; same && got != watch->length; ) {
+        ssize_t r = read(fd, buffer, sizeof(buffer));
+        if (r < 0 && errno == EINTR)
+            continue;
+        same = r > 0 && (size_t)r <= watch->length - got && !memcmp(buffer, watch->data + got, r);
+        got += same ? (size_t)r : 0;
+    }
+    if (fd >= 0)
+        close(fd);
+    return same;
+}
+
+/* Written to a temporary file which is renamed over the output */
+static bool watch_replace(const lambda_watch_t *watch, const char *path) {
+    size_t length    = strlen(path);
+    char  *temporary = (char *)malloc(length + sizeof(".XXXXXX"));
+    int    fd        = -1;
+    if (temporary) {
+        memcpy(temporary, path, length);
+        strcpy(temporary + length, ".XXXXXX");
+        fd = mkstemp(temporary);
+    }
+    bool success = fd >= 0;
+    for (size_t wrote = 0; success && wrote != watch->length; ) {
+        ssize_t r = write(fd, watch->data + wrote, watch->length - wrote);
+        if (r < 0 && errno == EINTR)
+            continue;
+        success = r > 0;
+        wrote  += success ? (size_t)r : 0;
+    }
+    if (fd >= 0) {
+        fchmod(fd, 0644);
+        if (close(fd))
+            success = false;
+    }
+    if (success && rename(temporary, path))
+        success = false;
+    if (!success) {
+        fprintf(stderr, "failed to write file %s: %s\n", path, strerror(errno));
+        if (fd >= 0)
+            unlink(temporary);
+    }
+    free(temporary);
+    return success;
 }
 
-static inline void parse_close(lambda_source_t *source) {
-    free(source->data);
+/* The output of a source, with the .l taken out like in batch mode */
+static char *watch_output(const lambda_watch_t *watch, const char *path) {
+    const char *slash = strrchr(path, '/');
+    char       *dir   = slash ? (char *)malloc(slash - path + 1) : NULL;
+    if (slash && !dir)
+        return NULL;
+    if (dir) {
+        memcpy(dir, path, slash - path);
+        dir[slash - path] = '\0';
+    }
+    char *outdir = watch_join(watch->outdir, dir ? dir : "");
+    char *output = outdir ? batch_output(outdir, path) : NULL;
+    free(outdir);
+    free(dir);
+    return output;
 }
 
-/* Parser */
-static inline size_t parse_skip_string(lambda_source_t *source, size_t i, char check) {
-    while (i != source->length) {
-        if (source->data[i] == check)
-            return i + 1;
-        else if (source->data[i] == '\\')
-            if (++i == source->length)
-                break;
-        ++i;
-    }
-    return i;
-}
-
-static inline size_t parse_skip_white(lambda_source_t *source, size_t i) {
-    while (i != source->length && isspace(source->data[i])) {
-        if (source->data[i] == '\n')
-            source->line++;
-        ++i;
-    }
-    return i;
-}
-
-static size_t parse_word(lambda_source_t *source, parse_data_t *data, size_t j, size_t i) {
-    if (j != i) {
-        if (strncmp(source->data + j, source->keyword, source->keylength) == 0)
-            return parse(source, data, i, PARSE_LAMBDA, false);
-    }
-    if (source->data[i] == '\n')
-        source->line++;
-    else if (!strncmp(source->data + i, "//", 2)) {
-        /* Single line comments */
-        i = strchr(source->data + i, '\n') - source->data;
-    } else if (!strncmp(source->data + i, "/*", 2)) {
-        /* Multi line comments */
-        i = strstr(source->data + i, "*/") - source->data;
-    }
-    return i;
-}
-
-#define ERROR ((size_t)-1)
-
-static size_t parse(lambda_source_t *source, parse_data_t *data, size_t i, parse_type_t parsetype, size_t *nameofs) {
-    lambda_vector_t parens;
-    size_t          lambda = 0;
-    bool            mark = (!parsetype && !nameofs);
-    size_t          protopos = i;
-    bool            protomove = true;
-    bool            preprocessor = false;
-    bool            expectbody = false;
-    bool            movename = false;
-    /* 'mark' actually means this is the outer most call and we should
-     * remember where to put prototypes now!
-     * when protomove is true we move the protopos along whitespace so that
-     * the lambdas don't get stuck to the tail of hte previous functions.
-     * Also we need to put lambdas after #include lines so if we encounter
-     * a preprocessor directive we create another position marker starting
-     * at the nest new line
-     */
+static lambda_watch_file_t *watch_find(lambda_watch_t *watch, const char *path) {
+    for (size_t f = 0; f != watch->nfiles; ++f) {
+        if (!strcmp(watch->files[f].path, path))
+            return &watch->files[f];
+    }
+    return NULL;
+}
+
+/* Translates the source at path when its key changed */
+static bool watch_file(lambda_watch_t *watch, const char *path) {
+    lambda_watch_file_t *file   = watch_find(watch, path);
+    char                *input  = watch_join(watch->root, path);
+    char                *output = watch_output(watch, path);
+    lambda_source_t      source = *watch->options;
+    lambda_stats_t       stats;
+    char                 key[LAMBDA_CACHE_KEY];
+    bool                 success = false;
+
+    if (!input || !output) {
+        fprintf(stderr, "%s: out of memory\n", path);
+        goto file_done;
+    }
+    memset(&stats, 0, sizeof(stats));
+    if (report_enabled(watch->report))
+        source.stats = &stats;
+    source.file = input;
+    stats.open.begin = lambda_clock();
+    if (!parse_open(&source, open(input, O_RDONLY))) {
+        fprintf(stderr, "failed to open file %s %s\n", input, strerror(errno));
+        goto file_done;
+    }
+    stats.open.duration = lambda_clock() - stats.open.begin;
 
-    lambda_vector_init(&parens, sizeof(char));
-
-
-    if (parsetype == PARSE_LAMBDA) {
-        if (!lambda_vector_create_lambda(&data->lambdas, &lambda))
-            goto parse_oom;
-        lambda_t *l = &data->lambdas.funcs[lambda];
-        l->start = i - 6;
-        i = parse_skip_white(source, i);
-        l->decl.begin = i;
-        l->decl_line = source->line;
-        size_t ofs = 0;
-        if ((i = parse(source, data, i, PARSE_TYPE, &ofs)) == ERROR)
-            goto parse_error;
-        l->name_offset = ofs - l->decl.begin;
-        l->decl.length = i - l->decl.begin;
-        l->body.begin = i;
-        l->body_line  = source->line;
-        i = parse_skip_white(source, i);
-        if (source->short_enabled) {
-            if (source->data[i] == '=' && source->data[i+1] == '>') {
-                l->body.begin = i += 2;
-                l->is_short = true;
-                parsetype = PARSE_LAMBDA_EXPRESSION;
+    lambda_cache_key(&source, key);
+    if (file && !strcmp(file->key, key)) {
+        parse_close(&source);
+        success = true;
+        goto file_done;
+    }
+
+    watch->length = 0;
+    output_init(watch->output, -1);
+    watch->output->sink = &watch_sink;
+    watch->output->user = watch;
+    success = generate(watch->output, &source, &watch->arena, watch->stream);
+    parse_close(&source);
+    if (source.stats)
+        report_stats(watch->report, source.file, &stats, 0);
+    watch->arena.peak = 0;
+
+    if (success && !watch_same(watch, output))
+        success = watch_replace(watch, output);
+    if (!success)
+        goto file_done;
+
+    if (!file) {
+        if (watch->nfiles == watch->afiles) {
+            size_t request = watch->afiles ? watch->afiles * 2 : 64;
+            lambda_watch_file_t *temp = (lambda_watch_file_t *)realloc(watch->files, request * sizeof(*temp));
+            if (!temp) {
+                fprintf(stderr, "%s: out of memory\n", path);
+                success = false;
+                goto file_done;
             }
+            watch->files  = temp;
+            watch->afiles = request;
         }
+        file = &watch->files[watch->nfiles];
+        if (!(file->path = strdup(path))) {
+            fprintf(stderr, "%s: out of memory\n", path);
+            success = false;
+            goto file_done;
+        }
+        watch->nfiles++;
     }
+    memcpy(file->key, key, sizeof(key));
 
-    size_t j = i;
-    while (i < source->length) {
-        if (mark && !parens.elements) {
-            if (protomove) {
-                if (isspace(source->data[i])) {
-                    if (source->data[i] == '\n')
-                        source->line++;
-                    protopos = j = ++i;
-                    continue;
-                }
-                protomove = false;
-                if (!lambda_vector_push_position(&data->positions, protopos, source->line))
-                    goto parse_oom;
-            }
+file_done:
+    free(input);
+    free(output);
+    return success;
+}
 
-            if (source->data[i] == ';') {
-                if (!nameofs && (i = parse_word(source, data, j, i)) == ERROR)
-                    goto parse_error;
-                j = ++i;
-                protomove = true;
-                protopos  = i;
-                continue;
-            }
+/* Removes the outputs of a source, or of all of the sources in a directory */
+static void watch_remove(lambda_watch_t *watch, const char *path, bool dir) {
+    size_t length = strlen(path);
+    for (size_t f = 0; f != watch->nfiles; ) {
+        lambda_watch_file_t *file = &watch->files[f];
+        if (dir ? strncmp(file->path, path, length) || file->path[length] != '/' : strcmp(file->path, path)) {
+            ++f;
+            continue;
+        }
+        char *output = watch_output(watch, file->path);
+        if (output)
+            unlink(output);
+        free(output);
+        free(file->path);
+        *file = watch->files[--watch->nfiles];
+    }
+    if (dir) {
+        char *outdir = watch_join(watch->outdir, path);
+        if (outdir)
+            rmdir(outdir); /* unless something else is in there */
+        free(outdir);
+    }
+    /* a directory moved away is still being watched */
+    for (size_t d = 0; dir && d != watch->ndirs; ) {
+        lambda_watch_dir_t *entry = &watch->dirs[d];
+        if (strncmp(entry->path, path, length) || (entry->path[length] && entry->path[length] != '/')) {
+            ++d;
+            continue;
+        }
+        inotify_rm_watch(watch->inotify, entry->wd);
+        free(entry->path);
+        *entry = watch->dirs[--watch->ndirs];
+    }
+}
 
-            if (source->data[i] == '#') {
-                if (!nameofs && (i = parse_word(source, data, j, i)) == ERROR)
-                    goto parse_error;
-                j = ++i;
-                protomove = false;
-                protopos  = i;
-                preprocessor = true;
-                continue;
-            }
-            if (preprocessor && source->data[i] == '\n') {
-                if (!nameofs && (i = parse_word(source, data, j, i)) == ERROR)
-                    goto parse_error;
-                j = ++i;
-                protomove = true;
-                protopos  = i;
-                preprocessor = false;
-                continue;
+/* Watches a directory and translates the sources in it and below it */
+static bool watch_dir(lambda_watch_t *watch, const char *path) {
+    char *dir    = watch_join(watch->root, path);
+    char *outdir = watch_join(watch->outdir, path);
+    DIR  *list   = NULL;
+    bool  success = false;
+    int   wd;
+
+    if (!dir || !outdir) {
+        fprintf(stderr, "%s: out of memory\n", watch->root);
+        goto dir_done;
+    }
+    /* watched before it is listed so that nothing created in between is missed */
+    if ((wd = inotify_add_watch(watch->inotify, dir, LAMBDA_WATCH_EVENTS)) < 0) {
+        fprintf(stderr, "failed to watch directory %s: %s\n", dir, strerror(errno));
+        goto dir_done;
+    }
+    size_t d = 0;
+    while (d != watch->ndirs && watch->dirs[d].wd != wd)
+        ++d;
+    if (d == watch->ndirs) {
+        if (watch->ndirs == watch->adirs) {
+            size_t request = watch->adirs ? watch->adirs * 2 : 16;
+            lambda_watch_dir_t *temp = (lambda_watch_dir_t *)realloc(watch->dirs, request * sizeof(*temp));
+            if (!temp) {
+                fprintf(stderr, "%s: out of memory\n", dir);
+                goto dir_done;
             }
+            watch->dirs  = temp;
+            watch->adirs = request;
         }
+        watch->dirs[d].wd   = wd;
+        watch->dirs[d].path = NULL;
+        watch->ndirs++;
+    }
+    free(watch->dirs[d].path);
+    if (!(watch->dirs[d].path = strdup(path))) {
+        watch->dirs[d] = watch->dirs[--watch->ndirs];
+        fprintf(stderr, "%s: out of memory\n", dir);
+        goto dir_done;
+    }
 
-        if (movename) {
-            if (source->data[i] != '*' && source->data[i] != '(' && !isspace(source->data[i]))
-                movename = false;
-            else if (source->data[i] != '(')
-                *nameofs = i+1;
-        }
-
-        if (source->data[i] == '"') {
-            if (!nameofs && (i = parse_word(source, data, j, i)) == ERROR)
-                goto parse_error;
-            j = i = parse_skip_string(source, i+1, source->data[i]);
-        } else if (source->data[i] == '\'') {
-            if (!nameofs && (i = parse_word(source, data, j, i)) == ERROR)
-                goto parse_error;
-            j = i = parse_skip_string(source, i+1, source->data[i]);
-        } else if (strchr("([{", source->data[i])) {
-            if (nameofs && !parens.elements) {
-                if (expectbody && source->data[i] == '{') {
-                    lambda_vector_destroy(&parens);
-                    return i;
-                }
-                if (!expectbody && source->data[i] == '(') {
-                    expectbody = true;
-                    movename = true;
-                    *nameofs = i;
-                }
-            }
-            if (!nameofs && (i = parse_word(source, data, j, i)) == ERROR)
-                goto parse_error;
-            if (!lambda_vector_push_char(&parens, strchr("([{)]}", source->data[i])[3]))
-                goto parse_oom;
-            j = ++i;
-        } else if (strchr(")]}", source->data[i])) {
-            if (!parens.elements) {
-                parse_error(source, "too many closing parenthesis");
-                goto parse_error;
-            }
-            char back = parens.chars[parens.elements >= 1 ? parens.elements - 1 : 0];
-            if (source->data[i] != back) {
-                parse_error(source, "mismatching `%c' and `%c'", back, source->data[i]);
-                goto parse_error;
-            }
-            if (parens.elements != 0)
-                parens.elements--;
-            if (source->data[i] == '}' && !parens.elements) {
-                if (parsetype == PARSE_LAMBDA)
-                    goto finish_lambda;
-                else if (nameofs) {
-                    if (!expectbody)
-                        movename = true;
-                }
-            }
-            bool domark = (mark && !parens.elements && source->data[i] == '}');
-            if (!nameofs && (i = parse_word(source, data, j, i)) == ERROR)
-                goto parse_error;
-            j = ++i;
-            if (domark) {
-                protopos = i;
-                protomove = true;
-            }
-        } else if (source->data[i] != '_' && !isalnum(source->data[i])) {
-            if (!nameofs && (i = parse_word(source, data, j, i)) == ERROR)
-                goto parse_error;
-            if (!parens.elements) {
-                if (parsetype == PARSE_LAMBDA_EXPRESSION && source->data[i] == ';')
-                    goto finish_lambda;
-                if (source->short_enabled) {
-                    if (parsetype == PARSE_TYPE && expectbody && source->data[i] == '=' && source->data[i+1] == '>') {
-                        lambda_vector_destroy(&parens);
-                        return i;
-                    }
-                }
-            }
-            j = ++i;
-        } else
-            ++i;
+    if (mkdir(outdir, 0777) && errno != EEXIST) {
+        fprintf(stderr, "failed to create directory %s: %s\n", outdir, strerror(errno));
+        goto dir_done;
+    }
+    if (!(list = opendir(dir))) {
+        fprintf(stderr, "failed to read directory %s: %s\n", dir, strerror(errno));
+        goto dir_done;
+    }
+    success = true;
+    for (struct dirent *entry; (entry = readdir(list)); ) {
+        struct stat st;
+        if (*entry->d_name == '.')
+            continue;
+        char *name = watch_join(path, entry->d_name);
+        char *full = name ? watch_join(watch->root, name) : NULL;
+        if (!full) {
+            fprintf(stderr, "%s: out of memory\n", dir);
+            success = false;
+        } else if (lstat(full, &st))
+            ;   /* gone already */
+        else if (S_ISDIR(st.st_mode)) {
+            if (st.st_dev != watch->out.st_dev || st.st_ino != watch->out.st_ino)
+                success = watch_dir(watch, name) && success;
+        } else if (watch_source(entry->d_name))
+            success = watch_file(watch, name) && success;
+        free(full);
+        free(name);
     }
 
-    lambda_vector_destroy(&parens);
-    return i;
+dir_done:
+    if (list)
+        closedir(list);
+    free(dir);
+    free(outdir);
+    return success;
+}
 
-parse_oom:
-    parse_error(source, "out of memory");
-parse_error:
-    lambda_vector_destroy(&parens);
-    return ERROR;
-finish_lambda:
-    {
-        lambda_t *l = &data->lambdas.funcs[lambda];
-        l->body.length = i - l->body.begin;
-        l->end_line = source->line;
-        lambda_vector_destroy(&parens);
-        return i;
+static void watch_event(lambda_watch_t *watch, const struct inotify_event *event) {
+    size_t d = 0;
+    while (d != watch->ndirs && watch->dirs[d].wd != event->wd)
+        ++d;
+    if (d == watch->ndirs)
+        return;
+    if (event->mask & IN_IGNORED) {
+        free(watch->dirs[d].path);
+        watch->dirs[d] = watch->dirs[--watch->ndirs];
+        return;
     }
-}
+    if (!event->len || *event->name == '.')
+        return;
 
-/* Generator */
-static inline void generate_marker(FILE *out, const char *file, size_t line, bool newline) {
-    fprintf(out, "%s#line %zu \"%s\"\n", newline ? "\n" : "", line, file);
+    char *path = watch_join(watch->dirs[d].path, event->name);
+    if (!path) {
+        fprintf(stderr, "%s: out of memory\n", watch->root);
+        return;
+    }
+    bool dir = event->mask & IN_ISDIR;
+    if (event->mask & (IN_DELETE | IN_MOVED_FROM))
+        watch_remove(watch, path, dir);
+    else if (dir && (event->mask & (IN_CREATE | IN_MOVED_TO)))
+        watch_dir(watch, path);
+    else if (!dir && (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) && watch_source(event->name))
+        watch_file(watch, path);
+    free(path);
 }
 
-static inline void generate_begin(FILE *out, lambda_source_t *source, lambda_vector_t *lambdas, size_t idx) {
-    generate_marker(out, source->file, lambdas->funcs[idx].decl_line, true);
-    fprintf(out, "static ");
-    size_t ofs = lambdas->funcs[idx].name_offset;
-    fwrite(source->data + lambdas->funcs[idx].decl.begin, ofs, 1, out);
-    fprintf(out, " lambda_%zu", idx);
-    fwrite(source->data + lambdas->funcs[idx].decl.begin+ofs, lambdas->funcs[idx].decl.length-ofs, 1, out);
+static bool watch_watching(const lambda_watch_t *watch) {
+    for (size_t d = 0; d != watch->ndirs; ++d) {
+        if (!*watch->dirs[d].path)
+            return true;
+    }
+    return false;
 }
 
-static size_t next_prototype_position(parse_data_t *data, size_t lam, size_t proto) {
-    if (lam == data->lambdas.elements)
-        return data->positions.elements;
-    for (; proto != data->positions.elements; ++proto) {
-        if (data->positions.positions[proto].pos > data->lambdas.funcs[lam].start)
-            return proto-1;
+/* Runs until it is terminated by a signal or the directory is gone */
+static bool watch_run(const lambda_source_t *options, const char *root, const char *outdir,
+                      bool stream, const lambda_report_t *report)
+{
+    _Alignas(struct inotify_event) char buffer[64 << 10];
+    lambda_watch_t watch;
+    memset(&watch, 0, sizeof(watch));
+    watch.options = options;
+    watch.root    = root;
+    watch.outdir  = outdir;
+    watch.stream  = stream;
+    watch.report  = report;
+
+    if (mkdir(outdir, 0777) && errno != EEXIST) {
+        fprintf(stderr, "failed to create directory %s: %s\n", outdir, strerror(errno));
+        return false;
+    }
+    if (stat(outdir, &watch.out)) {
+        fprintf(stderr, "failed to open directory %s: %s\n", outdir, strerror(errno));
+        return false;
+    }
+    if (!S_ISDIR(watch.out.st_mode)) {
+        fprintf(stderr, "%s is not a directory\n", outdir);
+        return false;
+    }
+    if ((watch.inotify = inotify_init1(IN_CLOEXEC)) < 0) {
+        fprintf(stderr, "failed to watch directory %s: %s\n", root, strerror(errno));
+        return false;
+    }
+    if (!(watch.output = output_create())) {
+        fprintf(stderr, "out of memory\n");
+        close(watch.inotify);
+        return false;
     }
-    return data->positions.elements-1;
+    lambda_arena_init(&watch.arena);
+
+    /* errors in the files are reported, the watch goes on */
+    watch_dir(&watch, "");
+    bool watching = watch_watching(&watch);
+    while (watching) {
+        ssize_t got = read(watch.inotify, buffer, sizeof(buffer));
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0) {
+            fprintf(stderr, "failed to watch directory %s: %s\n", root, strerror(errno));
+            break;
+        }
+        for (ssize_t at = 0; at < got; ) {
+            const struct inotify_event *event = (const struct inotify_event *)(buffer + at);
+            /* events were lost, the keys make a full scan cheap */
+            if (event->mask & IN_Q_OVERFLOW)
+                watch_dir(&watch, "");
+            else
+                watch_event(&watch, event);
+            at += sizeof(*event) + event->len;
+        }
+        if (!(watching = watch_watching(&watch)))
+            fprintf(stderr, "the watched directory %s is gone\n", root);
+    }
+
+    for (size_t f = 0; f != watch.nfiles; ++f)
+        free(watch.files[f].path);
+    for (size_t d = 0; d != watch.ndirs; ++d)
+        free(watch.dirs[d].path);
+    free(watch.files);
+    free(watch.dirs);
+    free(watch.data);
+    lambda_arena_destroy(&watch.arena);
+    output_destroy(watch.output);
+    close(watch.inotify);
+    return false;
+}
+#else
+static bool watch_run(const lambda_source_t *options, const char *root, const char *outdir,
+                      bool stream, const lambda_report_t *report)
+{
+    (void)options; (void)outdir; (void)stream; (void)report;
+    fprintf(stderr, "watching %s requires inotify\n", root);
+    return false;
 }
+#endif
+
+/* Server mode
+ *
+ * A client connects to the socket and sends a request header followed by the
+ * name of the file (for diagnostics) and the keywords, each terminated by a
+ * null byte. The descriptors to read the input from and to write the output
+ * and diagnostics to are passed along with the header, after the translation
+ * the server answers with the exit status.
+ */
+#define LAMBDA_SERVER_MAGIC   0x6c707031 /* "lpp1" */
+#define LAMBDA_SERVER_PAYLOAD 4096
+#define LAMBDA_SERVER_CACHE   (64 << 20)
+
+enum {
+    LAMBDA_REQUEST_SHORT           = 1 << 0,
+    LAMBDA_REQUEST_STREAM          = 1 << 1,
+    LAMBDA_REQUEST_STATS           = 1 << 2,
+    LAMBDA_REQUEST_STABLE          = 1 << 3,
+    LAMBDA_REQUEST_DEDUPE          = 1 << 4,
+    LAMBDA_REQUEST_INLINE          = 1 << 5,
+    LAMBDA_REQUEST_CHANGED_MARKERS = 1 << 6,
+    LAMBDA_REQUEST_NO_MARKERS      = 1 << 7,
+    LAMBDA_REQUEST_PREFIX          = 1 << 8, /* the payload has it after the file name */
+    LAMBDA_REQUEST_PREFIX_FILE     = 1 << 9,
+    LAMBDA_REQUEST_CXX             = 1 << 10
+};
+
+typedef struct {
+    uint32_t magic;
+    uint32_t flags;
+    uint32_t length; /* of the payload following the header */
+} lambda_request_t;
+
+/* Translations of regular files are cached by identity and options */
+typedef struct lambda_cache_entry_s lambda_cache_entry_t;
+
+struct lambda_cache_entry_s {
+    lambda_cache_entry_t *next;
+    dev_t                 dev;
+    ino_t                 ino;
+    off_t                 size;
+    struct timespec       mtime;
+    struct timespec       ctime;
+    uint32_t              flags;
+    char                 *payload;
+    size_t                length;
+    char                 *data;
+    size_t                size_data;
+    size_t                readers; /* writing it out without the lock held */
+    bool                  evicted; /* freed by the last of the readers */
+};
 
-static void generate_code(FILE *out, lambda_source_t *source, size_t pos, size_t len, parse_data_t *data, size_t lam, bool source_only);
-static void generate_functions(FILE *out, lambda_source_t *source, parse_data_t *data, size_t lam, size_t proto) {
-    size_t end = (proto+1) == data->positions.elements ? (size_t)-1 : data->positions.positions[proto+1].pos;
-    size_t first = lam;
-    for (; lam != data->lambdas.elements; ++lam) {
-        if (data->lambdas.funcs[lam].start > end)
+typedef struct {
+    pthread_mutex_t       mutex;
+    lambda_cache_entry_t *entries; /* most recently used first */
+    size_t                bytes;
+} lambda_cache_t;
+
+typedef struct {
+    const lambda_source_t *options;
+    int                    listener;
+    lambda_cache_t         cache;
+} lambda_server_t;
+
+/* The last keyword set a worker prepared, clients tend to use the same one */
+typedef struct {
+    lambda_source_t source;
+    uint32_t        flags;
+    char            payload[LAMBDA_SERVER_PAYLOAD];
+    size_t          length;
+    bool            valid;
+} lambda_server_keywords_t;
+
+static bool cache_match(const lambda_cache_entry_t *entry, const struct stat *st, uint32_t flags, const char *payload, size_t length) {
+    return entry->dev == st->st_dev && entry->ino == st->st_ino && entry->size == st->st_size
+        && entry->mtime.tv_sec == st->st_mtim.tv_sec && entry->mtime.tv_nsec == st->st_mtim.tv_nsec
+        && entry->ctime.tv_sec == st->st_ctim.tv_sec && entry->ctime.tv_nsec == st->st_ctim.tv_nsec
+        && entry->flags == flags && entry->length == length && !memcmp(entry->payload, payload, length);
+}
+
+static void cache_free(lambda_cache_entry_t *entry) {
+    free(entry->payload);
+    free(entry->data);
+    free(entry);
+}
+
+/* Writes out a cached translation, returns false when there is none */
+static bool cache_lookup(lambda_cache_t *cache, const struct stat *st, uint32_t flags, const char *payload, size_t length, int fd, bool *success) {
+    lambda_cache_entry_t **link;
+    lambda_cache_entry_t  *entry = NULL;
+
+    pthread_mutex_lock(&cache->mutex);
+    for (link = &cache->entries; *link; link = &(*link)->next) {
+        if (cache_match(*link, st, flags, payload, length)) {
+            entry = *link;
+            *link = entry->next;
+            entry->next = cache->entries;
+            cache->entries = entry;
             break;
+        }
     }
-    while (lam-- != first) {
-        lambda_t *lambda = &data->lambdas.funcs[lam];
-        generate_begin(out, source, &data->lambdas, lam);
-        if (lambda->is_short)
-            fprintf(out, "{");
-        generate_code(out, source, lambda->body.begin, lambda->body.length + 1, data, lam + 1, true);
-        if (lambda->is_short)
-            fprintf(out, "}");
-    }
-    fprintf(out, "\n");
-}
-
-/* when generating the actual code we also take prototype-positioning into account */
-static void generate_code(FILE *out, lambda_source_t *source, size_t pos, size_t len, parse_data_t *data, size_t lam, bool source_only) {
-    /* we know that positions always has at least 1 element, the 0, so the first search is there */
-    size_t proto = source_only ? data->positions.elements : next_prototype_position(data, lam, 1);
-    while (len) {
-        if (proto != data->positions.elements) {
-            lambda_position_t *lambdapos = &data->positions.positions[proto];
-            size_t point = lambdapos->pos;
-            if (pos <= point && pos+len >= point) {
-                /* we insert prototypes here! */
-                size_t length = point - pos;
-                fwrite(source->data + pos, length, 1, out);
-                generate_functions(out, source, data, lam, proto);
-                generate_marker(out, source->file, lambdapos->line, true);
-                len -= length;
-                pos += length;
-            }
+    if (entry)
+        entry->readers++;
+    pthread_mutex_unlock(&cache->mutex);
+    if (!entry)
+        return false;
+
+    /* a slow client only holds up its own worker, the entry stays around
+     * until it has been written even when it is evicted meanwhile
+     */
+    *success = true;
+    for (size_t wrote = 0; wrote != entry->size_data; ) {
+        ssize_t r = write(fd, entry->data + wrote, entry->size_data - wrote);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0) {
+            *success = false;
+            break;
         }
+        wrote += r;
+    }
+
+    pthread_mutex_lock(&cache->mutex);
+    bool unused = !--entry->readers && entry->evicted;
+    pthread_mutex_unlock(&cache->mutex);
+    if (unused)
+        cache_free(entry);
+    return true;
+}
+
+static void cache_insert(lambda_cache_t *cache, const struct stat *st, uint32_t flags, const char *payload, size_t length, const char *data, size_t size) {
+    if (size > LAMBDA_SERVER_CACHE / 4)
+        return;
+
+    lambda_cache_entry_t *entry = (lambda_cache_entry_t *)malloc(sizeof(*entry));
+    if (!entry)
+        return;
+    entry->payload = (char *)malloc(length + 1);
+    entry->data    = (char *)malloc(size + 1);
+    if (!entry->payload || !entry->data) {
+        cache_free(entry);
+        return;
+    }
+    memcpy(entry->payload, payload, length);
+    memcpy(entry->data, data, size);
+    entry->dev       = st->st_dev;
+    entry->ino       = st->st_ino;
+    entry->size      = st->st_size;
+    entry->mtime     = st->st_mtim;
+    entry->ctime     = st->st_ctim;
+    entry->flags     = flags;
+    entry->length    = length;
+    entry->size_data = size;
+    entry->readers   = 0;
+    entry->evicted   = false;
+
+    pthread_mutex_lock(&cache->mutex);
+    entry->next = cache->entries;
+    cache->entries = entry;
+    cache->bytes += size;
+    /* evict the least recently used entries */
+    while (cache->bytes > LAMBDA_SERVER_CACHE) {
+        lambda_cache_entry_t **link = &cache->entries;
+        while ((*link)->next)
+            link = &(*link)->next;
+        lambda_cache_entry_t *evicted = *link;
+        *link = NULL;
+        cache->bytes -= evicted->size_data;
+        if (evicted->readers)
+            evicted->evicted = true;
+        else
+            cache_free(evicted);
+    }
+    pthread_mutex_unlock(&cache->mutex);
+}
+
+static bool server_read(int fd, void *data, size_t length) {
+    for (size_t got = 0; got != length; ) {
+        ssize_t r = read(fd, (char *)data + got, length - got);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return false;
+        got += r;
+    }
+    return true;
+}
+
+static bool server_write(int fd, const void *data, size_t length) {
+    for (size_t wrote = 0; wrote != length; ) {
+        ssize_t r = write(fd, (const char *)data + wrote, length - wrote);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0)
+            return false;
+        wrote += r;
+    }
+    return true;
+}
+
+/* Receives the header and the three descriptors which come along with it */
+static bool server_receive(int fd, lambda_request_t *request, int fds[3]) {
+    union {
+        struct cmsghdr header;
+        char           buffer[CMSG_SPACE(3 * sizeof(int))];
+    } control;
+    struct iovec  iov = { .iov_base = request, .iov_len = sizeof(*request) };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
+
+    ssize_t r;
+    while ((r = recvmsg(fd, &msg, 0)) < 0 && errno == EINTR)
+        ;
+    if (r <= 0)
+        return false;
 
-        if (lam == data->lambdas.elements || data->lambdas.funcs[lam].start > pos + len) {
-            fwrite(source->data + pos, len, 1, out);
-            return;
+    int count = 0;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+        int    *passed = (int *)CMSG_DATA(cmsg);
+        size_t  many   = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (size_t i = 0; i != many; ++i) {
+            if (count < 3)
+                fds[count++] = passed[i];
+            else
+                close(passed[i]);
         }
+    }
 
-        lambda_t *lambda = &data->lambdas.funcs[lam];
-        size_t    length = lambda->body.begin + lambda->body.length + 1 - pos;
+    if (count != 3 || (msg.msg_flags & MSG_CTRUNC)
+        || ((size_t)r != sizeof(*request) && !server_read(fd, (char *)request + r, sizeof(*request) - r))
+        || request->magic != LAMBDA_SERVER_MAGIC || request->length > LAMBDA_SERVER_PAYLOAD)
+    {
+        while (count--)
+            close(fds[count]);
+        return false;
+    }
+    return true;
+}
 
-        fwrite(source->data + pos, lambda->start - pos, 1, out);
-        fprintf(out, "(&lambda_%zu)", lam);
+/* Sets up the source for the options of a request, reusing the previous
+ * keyword set when it is the same.
+ */
+static lambda_markers_t server_markers(uint32_t flags) {
+    return flags & LAMBDA_REQUEST_NO_MARKERS ? LAMBDA_MARKERS_NONE
+         : flags & LAMBDA_REQUEST_CHANGED_MARKERS ? LAMBDA_MARKERS_CHANGED : LAMBDA_MARKERS_ALL;
+}
 
-        len -= length;
-        pos += length;
+static bool server_source(lambda_server_t *server, lambda_server_keywords_t *warm, uint32_t flags,
+                          const char *keywords, size_t length, lambda_source_t *source)
+{
+    if (!length) {
+        *source = *server->options;
+        source->short_enabled = flags & LAMBDA_REQUEST_SHORT;
+        source->stable_names  = flags & LAMBDA_REQUEST_STABLE;
+        source->dedupe        = flags & LAMBDA_REQUEST_DEDUPE;
+        source->inline_all    = flags & LAMBDA_REQUEST_INLINE;
+        source->markers       = server_markers(flags);
+        source->cxx           = flags & LAMBDA_REQUEST_CXX;
+        return true;
+    }
 
-        for (++lam; lam != data->lambdas.elements && data->lambdas.funcs[lam].start < pos; ++lam)
-            ;
-        proto = next_prototype_position(data, lam, proto);
+    if (!warm->valid || warm->length != length || memcmp(warm->payload, keywords, length)) {
+        warm->valid  = false;
+        warm->length = length;
+        memcpy(warm->payload, keywords, length);
+        lambda_source_init(&warm->source);
+        for (size_t i = 0; i < length; i += strlen(warm->payload + i) + 1) {
+            if (!lambda_keywords_add(&warm->source.keywords, warm->payload + i))
+                return false;
+        }
+        lambda_source_prepare(&warm->source);
+        warm->source.cache = server->options->cache;
+        warm->valid = true;
     }
+    *source = warm->source;
+    source->short_enabled = flags & LAMBDA_REQUEST_SHORT;
+    source->stable_names  = flags & LAMBDA_REQUEST_STABLE;
+    source->dedupe        = flags & LAMBDA_REQUEST_DEDUPE;
+    source->inline_all    = flags & LAMBDA_REQUEST_INLINE;
+    source->markers       = server_markers(flags);
+    source->cxx           = flags & LAMBDA_REQUEST_CXX;
+    return true;
 }
 
+static void server_request(lambda_server_t *server, int client, lambda_arena_t *arena, lambda_output_t *out, lambda_server_keywords_t *warm) {
+    lambda_request_t request;
+    lambda_source_t  source;
+    char             payload[LAMBDA_SERVER_PAYLOAD + 1];
+    int              fds[3];
+    int32_t          status = 1;
 
-static void generate(FILE *out, lambda_source_t *source) {
-    parse_data_t data;
-    lambda_vector_init(&data.lambdas,   sizeof(data.lambdas.funcs[0]));
-    lambda_vector_init(&data.positions, sizeof(data.positions.positions[0]));
-    if (parse(source, &data, 0, PARSE_NORMAL, false) == ERROR) {
-        lambda_vector_destroy(&data.lambdas);
-        lambda_vector_destroy(&data.positions);
+    if (!server_receive(client, &request, fds))
         return;
+    if (!server_read(client, payload, request.length)) {
+        close(fds[0]);
+        goto server_request_done;
+    }
+    payload[request.length] = '\0';
+
+    size_t      names  = strnlen(payload, request.length);
+    size_t      skip   = names < request.length ? names + 1 : names;
+    const char *prefix = NULL;
+    if (request.flags & LAMBDA_REQUEST_PREFIX) {
+        prefix = payload + skip;
+        skip  += strnlen(prefix, request.length - skip);
+        skip  += skip < request.length;
+        if (!lambda_prefix_valid(prefix)) {
+            dprintf(fds[2], "invalid prefix: %s\n", prefix);
+            close(fds[0]);
+            goto server_request_done;
+        }
+    }
+    if (!server_source(server, warm, request.flags, payload + skip, request.length - skip, &source)) {
+        dprintf(fds[2], "invalid or too many keywords\n");
+        close(fds[0]);
+        goto server_request_done;
+    }
+    source.prefix      = prefix;
+    source.prefix_file = request.flags & LAMBDA_REQUEST_PREFIX_FILE;
+    lambda_stats_t stats;
+    memset(&stats, 0, sizeof(stats));
+    if (request.flags & LAMBDA_REQUEST_STATS)
+        source.stats = &stats;
+    source.file  = names ? payload : "<stdin>";
+    source.error = fds[2];
+
+    /* whether the output goes out in one piece or streamed doesn't change it */
+    struct stat st;
+    uint32_t    key       = request.flags & (LAMBDA_REQUEST_SHORT | LAMBDA_REQUEST_STABLE | LAMBDA_REQUEST_DEDUPE | LAMBDA_REQUEST_INLINE
+                                            | LAMBDA_REQUEST_CHANGED_MARKERS | LAMBDA_REQUEST_NO_MARKERS
+                                            | LAMBDA_REQUEST_PREFIX | LAMBDA_REQUEST_PREFIX_FILE | LAMBDA_REQUEST_CXX);
+    bool        cacheable = !fstat(fds[0], &st) && S_ISREG(st.st_mode);
+    bool        success;
+    if (cacheable && cache_lookup(&server->cache, &st, key, payload, request.length, fds[1], &success)) {
+        close(fds[0]);
+        if (request.flags & LAMBDA_REQUEST_STATS)
+            dprintf(fds[2], "%s: cached\n", source.file);
+        status = success ? 0 : 1;
+        goto server_request_done;
     }
 
-    generate_marker(out, source->file, 1, false);
+    stats.open.begin = lambda_clock();
+    if (!parse_open(&source, fds[0])) {
+        dprintf(fds[2], "failed to read file %s %s\n", source.file, strerror(errno));
+        goto server_request_done;
+    }
+    stats.open.duration = lambda_clock() - stats.open.begin;
+    output_init(out, fds[1]);
+    out->capturing = cacheable;
+    success = generate(out, &source, arena, request.flags & LAMBDA_REQUEST_STREAM);
+    parse_close(&source);
+    if (success && out->capturing)
+        cache_insert(&server->cache, &st, key, payload, request.length, out->capture, out->captured);
+    if (request.flags & LAMBDA_REQUEST_STATS)
+        lambda_stats_print(fds[2], source.file, &stats);
+    arena->peak = 0;
+    status = success ? 0 : 1;
+
+server_request_done:
+    close(fds[1]);
+    close(fds[2]);
+    server_write(client, &status, sizeof(status));
+}
 
-    generate_code(out, source, 0, source->length, &data, 0, false);
+/* Workers keep their arena, output buffer and keyword set warm between
+ * requests.
+ */
+static void *server_worker(void *argument) {
+    lambda_server_t          *server = (lambda_server_t *)argument;
+    lambda_output_t          *out    = output_create();
+    lambda_server_keywords_t *warm   = (lambda_server_keywords_t *)calloc(1, sizeof(*warm));
+    lambda_arena_t            arena;
+
+    lambda_arena_init(&arena);
+    while (out && warm) {
+        int client = accept(server->listener, NULL, NULL);
+        if (client < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            fprintf(stderr, "failed to accept a connection: %s\n", strerror(errno));
+            break;
+        }
+        server_request(server, client, &arena, out, warm);
+        close(client);
+    }
+    lambda_arena_destroy(&arena);
+    output_destroy(out);
+    free(warm);
+    return NULL;
+}
+
+static const char *server_path;
+
+static void server_signal(int signal) {
+    (void)signal;
+    unlink(server_path);
+    _exit(0);
+}
+
+static bool server_connect(const char *path, int *fd) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        errno = ENAMETOOLONG;
+        return false;
+    }
+    strcpy(address.sun_path, path);
+    if ((*fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        return false;
+    if (connect(*fd, (struct sockaddr *)&address, sizeof(address))) {
+        int saved = errno;
+        close(*fd);
+        errno = saved;
+        return false;
+    }
+    return true;
+}
+
+/* Runs until it is terminated by a signal */
+static bool server_run(const char *path, const lambda_source_t *options, size_t jobs) {
+    struct sockaddr_un address;
+    lambda_server_t    server;
+    int                fd;
+
+    if (server_connect(path, &fd)) {
+        close(fd);
+        fprintf(stderr, "a server is already listening on %s\n", path);
+        return false;
+    }
+    if (errno == ENAMETOOLONG) {
+        fprintf(stderr, "socket path too long: %s\n", path);
+        return false;
+    }
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+
+    /* a stale socket from a server which didn't shut down cleanly */
+    unlink(path);
+    if ((server.listener = socket(AF_UNIX, SOCK_STREAM, 0)) < 0
+        || bind(server.listener, (struct sockaddr *)&address, sizeof(address))
+        || listen(server.listener, SOMAXCONN))
+    {
+        fprintf(stderr, "failed to listen on %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    server_path = path;
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, &server_signal);
+    signal(SIGTERM, &server_signal);
+
+    server.options = options;
+    server.cache.entries = NULL;
+    server.cache.bytes = 0;
+    pthread_mutex_init(&server.cache.mutex, NULL);
+
+    for (size_t i = 1; i < jobs; ++i) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, &server_worker, &server))
+            break;
+        pthread_detach(thread);
+    }
+    server_worker(&server);
+    unlink(path);
+    return false;
+}
+
+/* Sends a translation request to the server and returns its status */
+static int client_run(const char *path, const char *file, const char *output, const lambda_source_t *options, bool stream, bool stats) {
+    lambda_request_t request;
+    char             payload[LAMBDA_SERVER_PAYLOAD];
+    size_t           length = 0;
+    int32_t          status = 1;
+    int              fd, fds[3] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+
+    /* the server falls back to its default keyword when there is none */
+    const char *name = file ? file : "";
+    size_t      size = strlen(name) + 1;
+    if (size > sizeof(payload)) {
+        fprintf(stderr, "file name too long: %s\n", name);
+        return 1;
+    }
+    memcpy(payload, name, size);
+    length += size;
+    if (options->prefix) {
+        size = strlen(options->prefix) + 1;
+        if (length + size > sizeof(payload)) {
+            fprintf(stderr, "prefix too long\n");
+            return 1;
+        }
+        memcpy(payload + length, options->prefix, size);
+        length += size;
+    }
+    for (size_t k = 0; k != options->keywords.count; ++k) {
+        size = options->keywords.words[k].length + 1;
+        if (length + size > sizeof(payload)) {
+            fprintf(stderr, "too many keywords\n");
+            return 1;
+        }
+        memcpy(payload + length, options->keywords.words[k].word, size);
+        length += size;
+    }
+
+    request.magic  = LAMBDA_SERVER_MAGIC;
+    request.length = length;
+    request.flags  = (options->short_enabled ? LAMBDA_REQUEST_SHORT : 0)
+                   | (options->stable_names ? LAMBDA_REQUEST_STABLE : 0)
+                   | (options->dedupe ? LAMBDA_REQUEST_DEDUPE : 0)
+                   | (options->inline_all ? LAMBDA_REQUEST_INLINE : 0)
+                   | (options->markers == LAMBDA_MARKERS_CHANGED ? LAMBDA_REQUEST_CHANGED_MARKERS : 0)
+                   | (options->markers == LAMBDA_MARKERS_NONE ? LAMBDA_REQUEST_NO_MARKERS : 0)
+                   | (options->prefix ? LAMBDA_REQUEST_PREFIX : 0)
+                   | (options->prefix_file ? LAMBDA_REQUEST_PREFIX_FILE : 0)
+                   | (options->cxx ? LAMBDA_REQUEST_CXX : 0)
+                   | (stream ? LAMBDA_REQUEST_STREAM : 0)
+                   | (stats  ? LAMBDA_REQUEST_STATS  : 0);
+
+    if (file && (fds[0] = open(file, O_RDONLY)) < 0) {
+        fprintf(stderr, "failed to open file %s %s\n", file, strerror(errno));
+        return 1;
+    }
+    if (output && (fds[1] = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0) {
+        fprintf(stderr, "failed to open file %s: %s\n", output, strerror(errno));
+        goto client_done;
+    }
+    if (!server_connect(path, &fd)) {
+        fprintf(stderr, "failed to connect to %s: %s\n", path, strerror(errno));
+        goto client_done;
+    }
 
-    /* there are cases where we get no newline at the end of the file */
-    fprintf(out, "\n");
+    union {
+        struct cmsghdr header;
+        char           buffer[CMSG_SPACE(sizeof(fds))];
+    } control;
+    struct iovec  iov = { .iov_base = &request, .iov_len = sizeof(request) };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    memset(&control, 0, sizeof(control));
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type  = SCM_RIGHTS;
+    cmsg->cmsg_len   = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    ssize_t r;
+    while ((r = sendmsg(fd, &msg, 0)) < 0 && errno == EINTR)
+        ;
+    if (r != (ssize_t)sizeof(request) || !server_write(fd, payload, length) || !server_read(fd, &status, sizeof(status))) {
+        fprintf(stderr, "lost the connection to %s\n", path);
+        status = 1;
+    }
+    close(fd);
+
+client_done:
+    if (fds[0] != STDIN_FILENO)
+        close(fds[0]);
+    if (fds[1] != STDOUT_FILENO && fds[1] >= 0)
+        close(fds[1]);
+    return status;
+}
 
-    lambda_vector_destroy(&data.lambdas);
-    lambda_vector_destroy(&data.positions);
+static size_t online_jobs(void) {
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    return online > 0 ? (size_t)online : 1;
 }
 
 static void usage(const char *prog, FILE *out) {
-    fprintf(out, "usage: %s [options] [<file>]\n", prog);
+    fprintf(out, "usage: %s [options] [<file>...]\n", prog);
     fprintf(out,
         "options:\n"
         "  -h, --help          print this help message\n"
         "  -V, --version       show the current program version\n"
-        "  -k, --keyword=WORD  change the lambda keyword to WORD\n"
-        "  -o, --output=FILE   write to FILE instead of stdout\n"
+        "  -k, --keyword=WORD  change the lambda keyword to WORD, when given\n"
+        "                      multiple times all of the WORDs are keywords\n"
+        "  -o, --output=FILE   write to FILE instead of stdout, with multiple\n"
+        "                      files FILE is the output directory\n"
+        "  -j, --jobs=N        translate up to N files at the same time, or parse\n"
+        "                      a large file on up to N threads\n"
         "  -s                  enable shortened syntax (default)\n"
-        "  -S                  disable shortened syntax\n");
+        "  -S                  disable shortened syntax\n"
+        "      --stream        write out each top-level statement as soon as it\n"
+        "                      has been parsed\n"
+        "      --stable-names  name lambdas after a hash of their text\n"
+        "      --dedupe        emit one function for lambdas with the same text\n"
+        "      --inline        declare all of the lambdas static inline\n"
+        "      --cxx           write C++ lambdas instead of functions where a\n"
+        "                      lambda has no captures\n"
+        "      --prefix[=NAME] name the lambdas lambda_NAME_N, with a NAME made\n"
+        "                      from the path of the file by default\n"
+        "      --unity         translate all of the files into one output, each\n"
+        "                      with the prefix of its path\n"
+        "      --markers=MODE  write #line markers at every function (all), only\n"
+        "                      where the lines are off (changed), or not (none)\n"
+        "      --stats[=FILE]  print statistics to stderr when done, or append\n"
+        "                      them to FILE as one line of JSON per file\n"
+        "      --trace=FILE    write a Chrome trace of the translations to FILE\n"
+        "      --cache-stats   print the hits and misses of the translation cache\n"
+        "      --server=SOCKET serve translations on the unix socket SOCKET,\n"
+        "                      using up to --jobs workers\n"
+        "      --client=SOCKET have the server on SOCKET do the translation\n"
+        "      --watch=DIR     keep the translations of the sources in DIR up to\n"
+        "                      date in the output directory until terminated\n"
+        "  @FILE               read input files from FILE, one per line\n");
 }
 
 static void version(FILE *out) {
-    fprintf(out, "lambdapp 0.1\n");
+    fprintf(out, "lambdapp " LAMBDAPP_VERSION "\n");
 }
 
 /* returns false when the parameter doesn't match,
@@ -557,7 +1489,7 @@ static bool isparam(int argc, char **argv, int *arg, char sh, const char *lng, c
     if (argv[*arg][0] != '-')
         return false;
     /* short version */
-    if (argv[*arg][1] == sh) {
+    if (sh && argv[*arg][1] == sh) {
         if (argv[*arg][2]) {
             *argarg = argv[*arg]+2;
             return true;
@@ -598,87 +1530,324 @@ static bool isparam(int argc, char **argv, int *arg, char sh, const char *lng, c
 
 int main(int argc, char **argv) {
     lambda_source_t source;
-    const char *file = NULL;
+    char      **files = NULL;
+    size_t      count = 0;
+    size_t      allocated = 0;
     const char *output = NULL;
-    FILE       *outfile = stdout;
+    const char *server = NULL;
+    const char *client = NULL;
+    const char *watch = NULL;
+    size_t      jobs = 0;
+    bool        stream = false;
+    bool        unity = false;
+    bool        options = true;
+    int         status = 1;
+    const char *trace = NULL;
+    lambda_trace_t  tracer;
+    lambda_report_t report = { false, -1, NULL };
 
     lambda_source_init(&source);
+    source.cache = getenv("LAMBDAPP_CACHE_DIR");
+    if (source.cache && !*source.cache)
+        source.cache = NULL;
 
-    int i = 1;
-    for (; i != argc; ++i) {
+    for (int i = 1; i != argc; ++i) {
         char *argarg;
 
-        if (!strcmp(argv[i], "--")) {
-            ++i;
-            break;
+        if (options && argv[i][0] == '-') {
+            if (!strcmp(argv[i], "--")) {
+                options = false;
+                continue;
+            }
+            if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help")) {
+                usage(argv[0], stdout);
+                status = 0;
+                goto done;
+            }
+            if (!strcmp(argv[i], "-V") || !strcmp(argv[i], "--version")) {
+                version(stdout);
+                status = 0;
+                goto done;
+            }
+            if (!strcmp(argv[i], "-s")) {
+              source.short_enabled = true;
+              continue;
+            }
+            if (!strcmp(argv[i], "-S")) {
+              source.short_enabled = false;
+              continue;
+            }
+            if (!strcmp(argv[i], "--stream")) {
+                stream = true;
+                continue;
+            }
+            if (!strcmp(argv[i], "--stable-names")) {
+                source.stable_names = true;
+                continue;
+            }
+            if (!strcmp(argv[i], "--dedupe")) {
+                source.dedupe = true;
+                continue;
+            }
+            if (!strcmp(argv[i], "--inline")) {
+                source.inline_all = true;
+                continue;
+            }
+            if (!strcmp(argv[i], "--cxx")) {
+                source.cxx = true;
+                continue;
+            }
+            if (!strcmp(argv[i], "--prefix")) {
+                source.prefix_file = true;
+                continue;
+            }
+            if (!strncmp(argv[i], "--prefix=", 9)) {
+                if (!lambda_prefix_valid(argv[i] + 9)) {
+                    fprintf(stderr, "%s: invalid prefix: %s\n", argv[0], argv[i] + 9);
+                    goto done;
+                }
+                source.prefix = argv[i] + 9;
+                continue;
+            }
+            if (!strcmp(argv[i], "--unity")) {
+                unity = true;
+                continue;
+            }
+            if (!strcmp(argv[i], "--cache-stats")) {
+                const char        *cache = getenv("LAMBDAPP_CACHE_DIR");
+                unsigned long long hits, misses;
+                if (!cache || !*cache) {
+                    fprintf(stderr, "%s: LAMBDAPP_CACHE_DIR is not set\n", argv[0]);
+                    goto done;
+                }
+                if (!lambda_cache_stats(cache, &hits, &misses)) {
+                    fprintf(stderr, "%s: failed to read the cache statistics: %s\n", argv[0], strerror(errno));
+                    goto done;
+                }
+                printf("hits %llu\nmisses %llu\n", hits, misses);
+                status = 0;
+                goto done;
+            }
+            if (!strcmp(argv[i], "--stats")) {
+                report.print = true;
+                continue;
+            }
+            if (!strncmp(argv[i], "--stats=", 8)) {
+                if (report.json >= 0)
+                    close(report.json);
+                report.json = open(argv[i] + 8, O_WRONLY | O_CREAT | O_APPEND, 0666);
+                if (report.json < 0) {
+                    fprintf(stderr, "%s: failed to open file %s: %s\n", argv[0], argv[i] + 8, strerror(errno));
+                    goto done;
+                }
+                continue;
+            }
+            if (isparam(argc, argv, &i, 0, "markers", &argarg)) {
+                if (i < 0)
+                    goto done;
+                if (!lambda_markers_parse(argarg, &source.markers)) {
+                    fprintf(stderr, "%s: invalid marker mode: %s\n", argv[0], argarg);
+                    goto done;
+                }
+                continue;
+            }
+            if (isparam(argc, argv, &i, 0, "trace", &argarg)) {
+                if (i < 0)
+                    goto done;
+                trace = argarg;
+                continue;
+            }
+            if (isparam(argc, argv, &i, 'k', "keyword", &argarg)) {
+                if (i < 0)
+                    goto done;
+                if (!lambda_keywords_add(&source.keywords, argarg)) {
+                    fprintf(stderr, "%s: invalid or too many keywords: %s\n", argv[0], argarg);
+                    goto done;
+                }
+                continue;
+            }
+            if (isparam(argc, argv, &i, 'o', "output", &argarg)) {
+                if (i < 0)
+                    goto done;
+                output = argarg;
+                continue;
+            }
+            if (isparam(argc, argv, &i, 0, "server", &argarg)) {
+                if (i < 0)
+                    goto done;
+                server = argarg;
+                continue;
+            }
+            if (isparam(argc, argv, &i, 0, "client", &argarg)) {
+                if (i < 0)
+                    goto done;
+                client = argarg;
+                continue;
+            }
+            if (isparam(argc, argv, &i, 0, "watch", &argarg)) {
+                if (i < 0)
+                    goto done;
+                watch = argarg;
+                continue;
+            }
+            if (isparam(argc, argv, &i, 'j', "jobs", &argarg)) {
+                if (i < 0)
+                    goto done;
+                char *end;
+                jobs = strtoul(argarg, &end, 10);
+                if (*end || !jobs) {
+                    fprintf(stderr, "%s: invalid number of jobs: %s\n", argv[0], argarg);
+                    goto done;
+                }
+                continue;
+            }
+            fprintf(stderr, "%s: unrecognized option: %s\n", argv[0], argv[i]);
+            usage(argv[0], stderr);
+            goto done;
         }
-        if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help")) {
-            usage(argv[0], stdout);
-            return 0;
+
+        if (options && argv[i][0] == '@') {
+            if (!batch_response(argv[i] + 1, &files, &count, &allocated)) {
+                fprintf(stderr, "%s: failed to read response file %s: %s\n", argv[0], argv[i] + 1, strerror(errno));
+                goto done;
+            }
+            continue;
         }
-        if (!strcmp(argv[i], "-V") || !strcmp(argv[i], "--version")) {
-            version(stdout);
-            return 0;
+
+        if (count == allocated) {
+            size_t request = allocated ? allocated * 2 : 16;
+            char **temp = (char **)realloc(files, request * sizeof(*temp));
+            if (!temp) {
+                fprintf(stderr, "%s: out of memory\n", argv[0]);
+                goto done;
+            }
+            files = temp;
+            allocated = request;
         }
-        if (!strcmp(argv[i], "-s")) {
-          source.short_enabled = true;
-          continue;
+        files[count++] = argv[i];
+    }
+
+    if (client) {
+        if (count > 1) {
+            fprintf(stderr, "%s: only 1 file allowed with --client\n", argv[0]);
+            goto done;
         }
-        if (!strcmp(argv[i], "-S")) {
-          source.short_enabled = false;
-          continue;
+        if (report.json >= 0 || trace) {
+            fprintf(stderr, "%s: only --stats to stderr is supported with --client\n", argv[0]);
+            goto done;
         }
-        if (isparam(argc, argv, &i, 'k', "keyword", &argarg)) {
-            if (i < 0)
-                return 1;
-            source.keyword = argarg;
-            continue;
+        if (unity || watch) {
+            fprintf(stderr, "%s: --unity and --watch aren't supported with --client\n", argv[0]);
+            goto done;
         }
-        if (isparam(argc, argv, &i, 'o', "output", &argarg)) {
-            if (i < 0)
-                return 1;
-            output = argarg;
-            continue;
+        status = client_run(client, count ? files[0] : NULL, output, &source, stream, report.print);
+        goto done;
+    }
+
+    lambda_source_prepare(&source);
+
+    if (trace) {
+        lambda_trace_init(&tracer);
+        report.trace = &tracer;
+    }
+
+    if (server) {
+        if (count || output || watch) {
+            fprintf(stderr, "%s: the server takes its files from clients\n", argv[0]);
+            goto done;
         }
-        if (argv[i][0] == '-') {
-            fprintf(stderr, "%s: unrecognized option: %s\n", argv[0], argv[i]);
-            usage(argv[0], stderr);
-            return 1;
+        if (report.json >= 0 || trace) {
+            fprintf(stderr, "%s: the server reports statistics to its clients\n", argv[0]);
+            goto done;
         }
-        if (file) {
-            fprintf(stderr, "%s: only 1 file allowed\n", argv[0]);
-            usage(argv[0], stderr);
-            return 1;
+        if (source.prefix || source.prefix_file || unity) {
+            fprintf(stderr, "%s: --prefix and --unity aren't supported with --server\n", argv[0]);
+            goto done;
         }
-        file = argv[i];
-    }
-    if (!file && i != argc)
-        file = argv[i++];
-    if (i != argc) {
-        fprintf(stderr, "%s: only 1 file allowed\n", argv[0]);
-        usage(argv[0], stderr);
-        return 1;
+        if (!jobs)
+            jobs = online_jobs();
+        server_run(server, &source, jobs);
+        goto done;
     }
 
-    source.file = file ? file : "<stdin>";
-    if (!parse_open(&source, file ? fopen(file, "r") : stdin)) {
-        fprintf(stderr, "failed to open file %s %s\n", source.file, strerror(errno));
-        return 1;
+    if (watch) {
+        if (count || unity || !output) {
+            fprintf(stderr, "%s: --watch translates the directory into the one given with -o\n", argv[0]);
+            goto done;
+        }
+        /* the files are translated one at a time, each on up to jobs threads */
+        source.jobs = jobs;
+        status = watch_run(&source, watch, output, stream, &report) ? 0 : 1;
+        goto done;
     }
 
-    source.keylength = strlen(source.keyword);
-
-    if (output) {
-        outfile = fopen(output, "w");
-        if (!outfile) {
-            fprintf(stderr, "failed to open file %s: %s\n", output, strerror(errno));
-            return 1;
+    /* Multiple files, or an output directory, mean batch mode */
+    struct stat st;
+    bool outdir = output && (output[strlen(output)-1] == '/' || (!stat(output, &st) && S_ISDIR(st.st_mode)));
+    if (unity) {
+        if (outdir) {
+            fprintf(stderr, "%s: --unity writes a single output file\n", argv[0]);
+            goto done;
+        }
+        if (source.prefix) {
+            fprintf(stderr, "%s: --unity gives every file a prefix of its own\n", argv[0]);
+            goto done;
+        }
+        if (!count) {
+            fprintf(stderr, "%s: --unity requires input files\n", argv[0]);
+            goto done;
         }
+        status = unity_run(&source, files, count, output, stream, &report) ? 0 : 1;
+        goto done;
+    }
+    if (count > 1 || outdir) {
+        if (!outdir) {
+            fprintf(stderr, "%s: multiple files require an output directory\n", argv[0]);
+            usage(argv[0], stderr);
+            goto done;
+        }
+        if (mkdir(output, 0777) && errno != EEXIST) {
+            fprintf(stderr, "%s: failed to create directory %s: %s\n", argv[0], output, strerror(errno));
+            goto done;
+        }
+        if (!jobs)
+            jobs = online_jobs();
+
+        lambda_batch_t batch;
+        memset(&batch, 0, sizeof(batch));
+        batch.options = &source;
+        batch.files   = (const char **)files;
+        batch.count   = count;
+        batch.outdir  = output;
+        batch.stream  = stream;
+        batch.report  = &report;
+        status = batch_run(&batch, jobs) ? 0 : 1;
+        goto done;
     }
-    generate(outfile, &source);
-    if (outfile != stdout)
-      fclose(outfile);
-    parse_close(&source);
 
-    return 0;
+    lambda_output_t *out = output_create();
+    lambda_arena_t   arena;
+    if (!out) {
+        fprintf(stderr, "%s: out of memory\n", argv[0]);
+        goto done;
+    }
+    /* a single file can still be parsed on multiple threads */
+    source.jobs = jobs;
+    lambda_arena_init(&arena);
+    status = translate(&source, count ? files[0] : NULL, output, STDOUT_FILENO, &arena, out, stream, &report, 0) ? 0 : 1;
+    lambda_arena_destroy(&arena);
+    output_destroy(out);
+
+done:
+    if (report.trace) {
+        if (!lambda_trace_write(report.trace, trace)) {
+            fprintf(stderr, "%s: failed to write the trace to %s: %s\n", argv[0], trace, strerror(errno));
+            status = 1;
+        }
+        lambda_trace_destroy(report.trace);
+    }
+    if (report.json >= 0)
+        close(report.json);
+    free(files);
+    return status;
 }
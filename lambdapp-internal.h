@@ -0,0 +1,230 @@
+/*
+* Copyright (C) 2014
+*   Wolfgang Bumiller
+*   Dale Weiler
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy of
+* this software and associated documentation files (the "Software"), to deal in
+* the Software without restriction, including without limitation the rights to
+* use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+* of the Software, and to permit persons to whom the Software is furnished to do
+* so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+#ifndef LAMBDAPP_INTERNAL_HDR
+#define LAMBDAPP_INTERNAL_HDR
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <pthread.h>
+#include <sys/uio.h>
+
+/* The translator shared by lambda-pp and lambda-cc */
+#define LAMBDAPP_VERSION "0.1"
+
+#define LAMBDA_KEYWORDS_MAX 16
+#define LAMBDA_KEYWORDS_SLOTS 64
+
+typedef struct {
+    const char *word;
+    size_t      length;
+    uint64_t    prefix; /* the first (up to) 8 bytes of the word */
+    uint64_t    mask;
+    size_t      next;   /* 1 + index of the next keyword in the same slot */
+} lambda_keyword_t;
+
+typedef struct {
+    lambda_keyword_t words[LAMBDA_KEYWORDS_MAX];
+    size_t           count;
+    size_t           minlength;
+    size_t           maxlength;
+    unsigned         multiplier;
+    unsigned char    slots[LAMBDA_KEYWORDS_SLOTS]; /* 1 + index, 0 when empty */
+    char             firsts[LAMBDA_KEYWORDS_MAX];  /* distinct first characters */
+    size_t           nfirsts;
+} lambda_keywords_t;
+
+/* Statistics of a translation, times are CLOCK_MONOTONIC nanoseconds */
+typedef struct {
+    uint64_t begin;
+    uint64_t duration;
+} lambda_span_t;
+
+typedef struct {
+    lambda_span_t open;     /* filled in by whoever opens the source */
+    lambda_span_t parse;    /* in streaming mode it includes writing the output */
+    lambda_span_t generate; /* all of generate(), the parse included */
+    size_t        bytes_in;
+    size_t        bytes_out;
+    size_t        lambdas;
+    size_t        depth;    /* of the most deeply nested lambda */
+    size_t        positions;
+    size_t        markers;
+    size_t        arena_peak;
+    size_t        arena_reserved;
+    bool          cached;
+    bool          plain;
+} lambda_stats_t;
+
+/* Which #line markers are written: at every function and after every
+ * insertion, only where the line the compiler counts is off, or none.
+ */
+typedef enum {
+    LAMBDA_MARKERS_ALL, LAMBDA_MARKERS_CHANGED, LAMBDA_MARKERS_NONE
+} lambda_markers_t;
+
+typedef struct {
+    const char *file;
+    const char *data;
+    size_t      length;
+    bool        mapped;
+    lambda_keywords_t keywords;
+    bool        short_enabled;
+    bool        stable_names; /* name lambdas after a hash of their text */
+    bool        dedupe;       /* emit lambdas with the same text only once */
+    bool        inline_all;   /* declare all lambdas inline */
+    const char *prefix;       /* names are lambda_<prefix>_N, NULL for lambda_N */
+    bool        prefix_file;  /* the prefix is derived from the file name */
+    bool        cxx;          /* C++ lambdas in place of functions where possible */
+    size_t      jobs;         /* threads to parse a large source on, without streaming */
+    lambda_markers_t markers;
+    bool        structural[256];
+    int         error;   /* where diagnostics are written to, -1 for nowhere */
+    char       *message; /* receives the first error when not NULL */
+    size_t      message_size;
+    const char *cache;   /* directory of the translation cache, or NULL */
+    lambda_stats_t *stats; /* collected by generate() when not NULL */
+} lambda_source_t;
+
+typedef struct lambda_arena_block_s lambda_arena_block_t;
+
+struct lambda_arena_block_s {
+    lambda_arena_block_t *next;
+    size_t                size;
+    size_t                used;
+    size_t                last; /* offset of the most recent allocation */
+    max_align_t           data[];
+};
+
+typedef struct {
+    lambda_arena_block_t *blocks;   /* the current block comes first */
+    size_t                reserved; /* bytes in all blocks */
+    size_t                used;     /* bytes handed out since the last reset */
+    size_t                peak;
+} lambda_arena_t;
+
+#define LAMBDA_OUTPUT_IOVECS  1024
+#define LAMBDA_OUTPUT_SCRATCH (16 << 10)
+
+/* Output is collected as a list of slices pointing into the source and into a
+ * scratch buffer holding the generated text, and written with writev().
+ */
+typedef struct {
+    int          fd;
+    struct iovec iov[LAMBDA_OUTPUT_IOVECS];
+    int          count;
+    char         scratch[LAMBDA_OUTPUT_SCRATCH];
+    size_t       used;
+    size_t       written;
+    size_t       markers; /* #line markers written */
+    bool         bol;      /* at the beginning of a line */
+    bool         counting; /* count the lines written */
+    size_t       line;     /* the line the compiler is at, when counting */
+    int          error; /* errno of the first failed write */
+    bool       (*sink)(void *user, const char *data, size_t length); /* instead of fd */
+    void        *user;
+    bool         capturing; /* keep a copy of everything written */
+    char        *capture;
+    size_t       captured;
+    size_t       capacity;
+} lambda_output_t;
+
+/* Arena */
+void lambda_arena_init(lambda_arena_t *arena);
+void lambda_arena_destroy(lambda_arena_t *arena);
+
+/* Options: keywords are added before lambda_source_prepare() is called, which
+ * falls back to the default keyword when there are none.
+ */
+bool lambda_keywords_add(lambda_keywords_t *set, const char *word);
+void lambda_source_init(lambda_source_t *source);
+void lambda_source_prepare(lambda_source_t *source);
+
+/* Reads the source from fd and closes it */
+bool parse_open(lambda_source_t *source, int fd);
+void parse_close(lambda_source_t *source);
+
+/* Takes the name of a marker mode: all, changed or none */
+bool lambda_markers_parse(const char *name, lambda_markers_t *markers);
+
+/* A prefix has to be a non-empty name, lambda_prefix() derives one from a
+ * file name and returns it allocated with malloc().
+ */
+bool lambda_prefix_valid(const char *prefix);
+char *lambda_prefix(const char *file);
+
+/* Whether an opened source has no keywords and so passes through unchanged */
+bool lambda_source_plain(const lambda_source_t *source);
+
+/* Outputs are created once and can be initialized for any number of
+ * translations, keeping their capture buffer.
+ */
+lambda_output_t *output_create(void);
+void output_destroy(lambda_output_t *out);
+void output_init(lambda_output_t *out, int fd);
+
+/* Translation cache: entries are named by a hash of the input and of all the
+ * options which change the output, with counters of hits and misses kept in
+ * the file "stats" of the cache directory.
+ */
+#define LAMBDA_CACHE_KEY 33
+
+void lambda_cache_key(const lambda_source_t *source, char key[LAMBDA_CACHE_KEY]);
+int  lambda_cache_open(const lambda_source_t *source); /* -1 on a miss */
+void lambda_cache_count(const char *dir, bool hit);
+bool lambda_cache_stats(const char *dir, unsigned long long *hits, unsigned long long *misses);
+
+/* Translates an opened source and writes it to out, the arena is reset when
+ * done. With a cache the translation comes from there when it can.
+ */
+bool generate(lambda_output_t *out, lambda_source_t *source, lambda_arena_t *arena, bool stream);
+
+/* Statistics are printed as text or written as a line of JSON in one write,
+ * so that any number of threads and processes can append them to one file.
+ */
+uint64_t lambda_clock(void);
+void lambda_stats_print(int fd, const char *file, const lambda_stats_t *stats);
+bool lambda_stats_json(int fd, const char *file, const lambda_stats_t *stats);
+
+/* Writes text quoted as a JSON string, returns the length it needs like
+ * snprintf() does.
+ */
+size_t lambda_json_string(char *buffer, size_t size, const char *text);
+
+/* Traces collect complete events from any number of threads, which are
+ * written in the Chrome trace event format at the end.
+ */
+typedef struct {
+    pthread_mutex_t mutex;
+    char           *events;
+    size_t          used;
+    size_t          size;
+} lambda_trace_t;
+
+void lambda_trace_init(lambda_trace_t *trace);
+void lambda_trace_destroy(lambda_trace_t *trace);
+void lambda_trace_event(lambda_trace_t *trace, const char *name, const char *file, const lambda_span_t *span, unsigned tid);
+bool lambda_trace_write(lambda_trace_t *trace, const char *path);
+
+#endif
@@ -0,0 +1,2466 @@
+/*
+* Copyright (C) 2014
+*   Wolfgang Bumiller
+*   Dale Weiler
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy of
+* this software and associated documentation files (the "Software"), to deal in
+* the Software without restriction, including without limitation the rights to
+* use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+* of the Software, and to permit persons to whom the Software is furnished to do
+* so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "lambdapp.h"
+#include "lambdapp-internal.h"
+
+#define isalpha(a) ((((unsigned)(a)|32)-'a') < 26)
+#define isdigit(a) (((unsigned)(a)-'0') < 10)
+#define isalnum(a) (isalpha(a) || isdigit(a))
+#define isspace(a) (((a) >= '\t' && (a) <= '\r') || (a) == ' ')
+#define isident(a) ((a) == '_' || isalnum(a))
+
+static const char *DefaultKeyword = "lambda";
+
+/* Offsets into the source are 32 bits wide, which halves the size of the
+ * tables of the parser, unless built with LAMBDAPP_LARGE_FILES for sources of
+ * 4 GiB and more. Counts of lambdas are bounded by the length of the source
+ * and use the same type.
+ */
+#ifdef LAMBDAPP_LARGE_FILES
+typedef size_t lambda_offset_t;
+#define LAMBDA_OFFSET_MAX SIZE_MAX
+#else
+typedef uint32_t lambda_offset_t;
+#define LAMBDA_OFFSET_MAX UINT32_MAX
+#endif
+
+typedef struct {
+    lambda_offset_t begin;
+    lambda_offset_t length;
+} lambda_range_t;
+
+/* Where a lambda starts is kept in a table of its own alongside, which the
+ * generator searches over and over.
+ */
+typedef struct {
+    uint64_t        hash;      /* of the declaration and the body */
+    lambda_range_t  captures;  /* inside the brackets, empty without captures */
+    lambda_range_t  decl;
+    lambda_range_t  body;
+    lambda_offset_t name_offset;
+    lambda_offset_t same;      /* earlier lambdas with the same hash */
+    lambda_offset_t number;    /* dedupe: the index of the function used */
+    unsigned        attributes;
+    bool            is_short;
+    bool            duplicate; /* dedupe: uses the function of an identical lambda */
+} lambda_t;
+
+typedef struct {
+    uint64_t        hash;
+    lambda_offset_t count;  /* 0 for an empty slot */
+    lambda_offset_t begin;
+    lambda_offset_t length;
+    lambda_offset_t number;
+    lambda_offset_t same;
+    unsigned        attributes;
+    bool            emitted; /* dedupe: the lambda whose function is used by the others */
+} lambda_name_t;
+
+typedef enum {
+    PARSE_NORMAL, PARSE_TYPE, PARSE_LAMBDA, PARSE_LAMBDA_EXPRESSION
+} parse_type_t;
+
+typedef struct {
+    parse_type_t type;
+    size_t       parens;  /* depth of the bracket stack the frame started at */
+    size_t       lambda;  /* lambda frames: the one being parsed */
+    size_t       nameofs; /* type frames: where the name goes */
+    bool         expectbody;
+    bool         movename;
+} parse_frame_t;
+
+typedef struct {
+    union {
+        char              *chars;
+        lambda_t          *funcs;
+        parse_frame_t     *frames;
+        lambda_offset_t   *offsets;
+    };
+    size_t          size;
+    size_t          elements;
+    size_t          length;
+    lambda_arena_t *arena;
+} lambda_vector_t;
+
+/* All of the parse state is allocated from one arena which the caller resets
+ * between translations.
+ */
+typedef struct {
+  lambda_arena_t *arena;
+  lambda_vector_t lambdas;
+  lambda_vector_t starts;      /* of the lambdas */
+  lambda_vector_t positions;
+  lambda_vector_t parens;      /* bracket stack shared by all parser frames */
+  lambda_vector_t frames;
+  lambda_output_t *stream;     /* streaming mode: completed regions go here */
+  size_t          flushed;     /* offset up to which output has been written */
+  size_t          lambda_base; /* number of lambdas already written out */
+  size_t          released;    /* offset up to which mapped pages were dropped */
+  lambda_name_t  *names;       /* stable names and dedupe: hashes of all the lambdas so far */
+  size_t          names_size;
+  size_t          names_used;
+  bool            failed;      /* generating ran out of memory */
+  size_t          depth;       /* of the most deeply nested lambda */
+  size_t          positions_flushed;
+  bool            boundary;    /* segments: the parse ended at a top-level boundary */
+  bool            resync;      /* streaming: the flushed region ended in a replaced lambda */
+  lambda_vector_t newlines;    /* offsets of the newlines before indexed */
+  size_t          indexed;
+} parse_data_t;
+
+static void generate_flush(lambda_source_t *source, parse_data_t *data, size_t upto);
+
+/* Arena */
+#define LAMBDA_ARENA_BLOCK (64 << 10)
+
+static inline size_t lambda_arena_align(size_t size) {
+    return (size + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1);
+}
+
+void lambda_arena_init(lambda_arena_t *arena) {
+    memset(arena, 0, sizeof(*arena));
+}
+
+static lambda_arena_block_t *lambda_arena_block(size_t size) {
+    lambda_arena_block_t *block = (lambda_arena_block_t *)malloc(sizeof(*block) + size);
+    if (block) {
+        block->size = size;
+        block->used = block->last = 0;
+    }
+    return block;
+}
+
+/* Requests which don't fit into the current block get a block of their own
+ * when they are large, so big vectors can later be grown with realloc()
+ * instead of leaving copies of themselves behind.
+ */
+static void *lambda_arena_alloc(lambda_arena_t *arena, size_t size) {
+    lambda_arena_block_t *block = arena->blocks;
+    size = lambda_arena_align(size);
+    if (!block || block->size - block->used < size) {
+        bool   large   = (size >= LAMBDA_ARENA_BLOCK);
+        size_t request = large ? size : block ? block->size * 2 : LAMBDA_ARENA_BLOCK;
+        if (!large && request > LAMBDA_ARENA_BLOCK * 16)
+            request = LAMBDA_ARENA_BLOCK * 16;
+        if (!(block = lambda_arena_block(request)))
+            return NULL;
+        if (large && arena->blocks) {
+            block->next = arena->blocks->next;
+            arena->blocks->next = block;
+        } else {
+            block->next = arena->blocks;
+            arena->blocks = block;
+        }
+        arena->reserved += request;
+    }
+    block->last  = block->used;
+    block->used += size;
+    if ((arena->used += size) > arena->peak)
+        arena->peak = arena->used;
+    return (char *)block->data + block->last;
+}
+
+/* Vectors double in size, when the vector is the most recent allocation in
+ * the current block it simply grows in place and when it has a block of its
+ * own that block is reallocated, otherwise it moves and the old space stays
+ * unused until the arena is reset.
+ */
+static void *lambda_arena_grow(lambda_arena_t *arena, void *data, size_t size, size_t request) {
+    lambda_arena_block_t **link = &arena->blocks;
+    lambda_arena_block_t  *block = arena->blocks;
+    size    = lambda_arena_align(size);
+    request = lambda_arena_align(request);
+    if (block && data == (char *)block->data + block->last && block->size - block->last >= request) {
+        block->used = block->last + request;
+        if ((arena->used += request - size) > arena->peak)
+            arena->peak = arena->used;
+        return data;
+    }
+    for (; (block = *link); link = &block->next) {
+        if (data != (void *)block->data || block->used != size || block == arena->blocks)
+            continue;
+        if (!(block = (lambda_arena_block_t *)realloc(block, sizeof(*block) + request)))
+            return NULL;
+        *link = block;
+        arena->reserved += request - block->size;
+        block->size = block->used = request;
+        if ((arena->used += request - size) > arena->peak)
+            arena->peak = arena->used;
+        return block->data;
+    }
+    void *moved = lambda_arena_alloc(arena, request);
+    if (moved)
+        memcpy(moved, data, size);
+    return moved;
+}
+
+void lambda_arena_destroy(lambda_arena_t *arena) {
+    lambda_arena_block_t *block;
+    while ((block = arena->blocks)) {
+        arena->blocks = block->next;
+        free(block);
+    }
+    arena->reserved = 0;
+}
+
+/* Keeps the memory around for the next translation: when it took more than
+ * one block they are replaced by a single one large enough for all of it.
+ */
+static void lambda_arena_reset(lambda_arena_t *arena) {
+    lambda_arena_block_t *block = arena->blocks;
+    arena->used = 0;
+    if (!block)
+        return;
+    if (block->next) {
+        size_t reserved = arena->reserved;
+        lambda_arena_destroy(arena);
+        if ((block = lambda_arena_block(reserved))) {
+            block->next     = NULL;
+            arena->blocks   = block;
+            arena->reserved = reserved;
+        }
+    }
+    if (block)
+        block->used = block->last = 0;
+}
+
+/* Vector */
+static inline bool lambda_vector_init(lambda_vector_t *vec, lambda_arena_t *arena, size_t size) {
+    vec->length   = 32;
+    vec->size     = size;
+    vec->elements = 0;
+    vec->arena    = arena;
+    return (vec->chars = (char *)lambda_arena_alloc(arena, vec->length * vec->size));
+}
+
+static inline bool lambda_vector_resize(lambda_vector_t *vec) {
+    if (vec->elements != vec->length)
+        return true;
+    char *temp = (char *)lambda_arena_grow(vec->arena, vec->chars, vec->length * vec->size, vec->length * 2 * vec->size);
+    if (!temp)
+        return false;
+    vec->length <<= 1;
+    vec->chars = temp;
+    return true;
+}
+
+static inline bool lambda_vector_push_char(lambda_vector_t *vec, char ch) {
+    if (!lambda_vector_resize(vec))
+        return false;
+    vec->chars[vec->elements++] = ch;
+    return true;
+}
+
+static inline bool lambda_vector_push_offset(lambda_vector_t *vec, size_t offset) {
+    if (!lambda_vector_resize(vec))
+        return false;
+    vec->offsets[vec->elements++] = offset;
+    return true;
+}
+
+/* Keywords */
+bool lambda_keywords_add(lambda_keywords_t *set, const char *word) {
+    size_t length = strlen(word);
+    if (!length || set->count == LAMBDA_KEYWORDS_MAX)
+        return false;
+    for (const char *c = word; *c; ++c)
+        if (!isident(*c))
+            return false;
+
+    lambda_keyword_t *keyword = &set->words[set->count++];
+    size_t            prefix  = length < 8 ? length : 8;
+    memset(keyword, 0, sizeof(*keyword));
+    keyword->word   = word;
+    keyword->length = length;
+    memcpy(&keyword->prefix, word, prefix);
+    memset(&keyword->mask, 0xFF, prefix);
+    return true;
+}
+
+static inline size_t lambda_keywords_slot(const lambda_keywords_t *set, const char *word, size_t length) {
+    return ((unsigned char)word[0] * set->multiplier + (unsigned char)word[length-1] + length) % LAMBDA_KEYWORDS_SLOTS;
+}
+
+/* Hashes the keywords on their first and last character and their length,
+ * picking the multiplier with the fewest collisions, which for the handful of
+ * keywords anyone uses is a perfect hash. Keywords which still end up in the
+ * same slot are chained.
+ */
+static void lambda_keywords_build(lambda_keywords_t *set) {
+    size_t   best = (size_t)-1;
+    unsigned chosen = 1;
+    for (unsigned multiplier = 1; multiplier < 256 && best; ++multiplier) {
+        unsigned char used[LAMBDA_KEYWORDS_SLOTS] = { 0 };
+        size_t        collisions = 0;
+        set->multiplier = multiplier;
+        for (size_t k = 0; k != set->count; ++k)
+            collisions += used[lambda_keywords_slot(set, set->words[k].word, set->words[k].length)]++ != 0;
+        if (collisions < best) {
+            best   = collisions;
+            chosen = multiplier;
+        }
+    }
+    set->multiplier = chosen;
+
+    memset(set->slots, 0, sizeof(set->slots));
+    set->minlength = (size_t)-1;
+    set->maxlength = 0;
+    set->nfirsts   = 0;
+    for (size_t k = set->count; k--; ) {
+        lambda_keyword_t *keyword = &set->words[k];
+        size_t            slot    = lambda_keywords_slot(set, keyword->word, keyword->length);
+        keyword->next   = set->slots[slot];
+        set->slots[slot] = k + 1;
+        if (keyword->length < set->minlength)
+            set->minlength = keyword->length;
+        if (keyword->length > set->maxlength)
+            set->maxlength = keyword->length;
+        if (!memchr(set->firsts, keyword->word[0], set->nfirsts))
+            set->firsts[set->nfirsts++] = keyword->word[0];
+    }
+}
+
+/* Returns the length of the keyword which the word at i is, or 0 when it isn't
+ * one. The caller checks that i is the start of a word.
+ */
+static inline size_t lambda_keywords_match(const lambda_keywords_t *set, const char *data, size_t length, size_t i) {
+    const char *word = data + i;
+    size_t      end  = i + set->maxlength + 1;
+    size_t      j    = i;
+    if (end > length)
+        end = length;
+    while (j != end && isident(data[j]))
+        ++j;
+    size_t wordlength = j - i;
+    if (wordlength < set->minlength || wordlength > set->maxlength)
+        return 0;
+
+    uint64_t value = 0;
+    if (i + 8 <= length)
+        memcpy(&value, word, 8);
+    else
+        memcpy(&value, word, wordlength < 8 ? wordlength : 8);
+
+    size_t k = set->slots[lambda_keywords_slot(set, word, wordlength)];
+    for (; k; k = set->words[k-1].next) {
+        const lambda_keyword_t *keyword = &set->words[k-1];
+        if (keyword->length != wordlength || (value & keyword->mask) != keyword->prefix)
+            continue;
+        if (wordlength <= 8 || !memcmp(word + 8, keyword->word + 8, wordlength - 8))
+            return wordlength;
+    }
+    return 0;
+}
+
+static bool parse_data_init(parse_data_t *data, lambda_arena_t *arena) {
+    memset(data, 0, sizeof(*data));
+    data->arena = arena;
+    bool success = lambda_vector_init(&data->lambdas,   arena, sizeof(data->lambdas.funcs[0]));
+    success     &= lambda_vector_init(&data->starts,    arena, sizeof(data->starts.offsets[0]));
+    success     &= lambda_vector_init(&data->positions, arena, sizeof(data->positions.offsets[0]));
+    success     &= lambda_vector_init(&data->parens,    arena, sizeof(data->parens.chars[0]));
+    success     &= lambda_vector_init(&data->frames,    arena, sizeof(data->frames.frames[0]));
+    success     &= lambda_vector_init(&data->newlines,  arena, sizeof(data->newlines.offsets[0]));
+    return success;
+}
+
+/* A lambda and its start go into both of the tables at once */
+static inline bool parse_create_lambda(parse_data_t *data, size_t start, size_t *idx) {
+    if (!lambda_vector_resize(&data->lambdas) || !lambda_vector_push_offset(&data->starts, start))
+        return false;
+    *idx = data->lambdas.elements++;
+    memset(&data->lambdas.funcs[*idx], 0, sizeof(lambda_t));
+    return true;
+}
+
+void lambda_source_init(lambda_source_t *source) {
+    memset(source, 0, sizeof(*source));
+    source->short_enabled = true;
+    source->error         = STDERR_FILENO;
+}
+
+/* Has to be called once the options are known. Builds the table of bytes the
+ * parser has to stop at when it isn't looking for anything in particular:
+ * everything else is either part of a word or whitespace.
+ */
+void lambda_source_prepare(lambda_source_t *source) {
+    static const char structural[] = "\"'()[]{};#/\n";
+
+    if (!source->keywords.count)
+        lambda_keywords_add(&source->keywords, DefaultKeyword);
+    lambda_keywords_build(&source->keywords);
+
+    memset(source->structural, 0, sizeof(source->structural));
+    for (const char *c = structural; *c; ++c)
+        source->structural[(unsigned char)*c] = true;
+    for (size_t k = 0; k != source->keywords.nfirsts; ++k)
+        source->structural[(unsigned char)source->keywords.firsts[k]] = true;
+}
+
+bool lambda_markers_parse(const char *name, lambda_markers_t *markers) {
+    static const char *const names[] = { "all", "changed", "none" };
+    for (size_t m = 0; m != sizeof(names) / sizeof(*names); ++m) {
+        if (!strcmp(name, names[m])) {
+            *markers = (lambda_markers_t)m;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool lambda_prefix_valid(const char *prefix) {
+    if (!*prefix)
+        return false;
+    for (const char *c = prefix; *c; ++c)
+        if (!isident(*c))
+            return false;
+    return true;
+}
+
+/* Every run of characters which can't be in a name becomes one '_', without
+ * any at either end: src/foo.c becomes src_foo_c.
+ */
+char *lambda_prefix(const char *file) {
+    char  *prefix   = (char *)malloc(strlen(file) + sizeof("file"));
+    size_t length   = 0;
+    bool   separate = false;
+    if (!prefix)
+        return NULL;
+    for (const char *c = file; *c; ++c) {
+        if (!isident(*c)) {
+            separate = true;
+            continue;
+        }
+        if (separate && length)
+            prefix[length++] = '_';
+        separate = false;
+        prefix[length++] = *c;
+    }
+    if (!length)
+        memcpy(prefix, "file", length = 4);
+    prefix[length] = '\0';
+    return prefix;
+}
+
+/* Source */
+static size_t parse_line(const lambda_source_t *source, size_t at) {
+    const char *end  = source->data + at;
+    size_t      line = 1;
+    for (const char *find = source->data; find != end && (find = (const char *)memchr(find, '\n', end - find)); ++find)
+        ++line;
+    return line;
+}
+
+/* Reports an error at the offset at */
+static void parse_error(lambda_source_t *source, size_t at, const char *message, ...) {
+    char buffer[2048];
+    if (source->error < 0 && !(source->message && !source->message[0]))
+        return;
+    va_list va;
+    va_start(va, message);
+    vsnprintf(buffer, sizeof(buffer), message, va);
+    va_end(va);
+    size_t line = parse_line(source, at);
+    if (source->error >= 0)
+        dprintf(source->error, "%s:%zu error: %s\n", source->file, line, buffer);
+    if (source->message && !source->message[0])
+        snprintf(source->message, source->message_size, "%s:%zu error: %s", source->file, line, buffer);
+}
+
+bool parse_open(lambda_source_t *source, int fd) {
+    struct stat st;
+    char       *data = NULL;
+    size_t      allocated = 4096;
+
+    if (fd < 0)
+        return false;
+
+    source->length = 0;
+
+    /* Regular files are mapped and parsed in place, the generator then writes
+     * slices straight out of the mapping.
+     */
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        if (st.st_size > 0) {
+            void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map != MAP_FAILED) {
+                madvise(map, st.st_size, MADV_SEQUENTIAL);
+                source->data   = (const char *)map;
+                source->length = st.st_size;
+                source->mapped = true;
+                close(fd);
+                return true;
+            }
+        }
+        /* files like the ones in /proc report a size of 0 */
+        if ((size_t)st.st_size >= allocated)
+            allocated = st.st_size + 1;
+    }
+
+    /* Everything else (pipes, terminals) is read into a buffer which grows
+     * geometrically so large inputs don't get copied over and over.
+     */
+    if (!(data = (char *)malloc(allocated)))
+        goto parse_open_oom;
+    while (true) {
+        if (source->length == allocated) {
+            char *temp = (char *)realloc(data, allocated * 2);
+            if (!temp)
+                goto parse_open_oom;
+            data = temp;
+            allocated *= 2;
+        }
+        ssize_t r = read(fd, data + source->length, allocated - source->length);
+        if (r == 0)
+            break;
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            goto parse_open_failed;
+        }
+        source->length += r;
+    }
+
+    source->data = data;
+    close(fd);
+    return true;
+
+parse_open_oom:
+    parse_error(source, 0, "out of memory");
+parse_open_failed:
+    free(data);
+    close(fd);
+    return false;
+}
+
+void parse_close(lambda_source_t *source) {
+    if (source->mapped)
+        munmap((void *)source->data, source->length);
+    else
+        free((void *)source->data);
+}
+
+/* Parser */
+static inline size_t parse_skip_string(lambda_source_t *source, size_t i, char check) {
+    while (i != source->length) {
+        if (source->data[i] == check)
+            return i + 1;
+        else if (source->data[i] == '\\')
+            if (++i == source->length)
+                break;
+        ++i;
+    }
+    return i;
+}
+
+static inline size_t parse_skip_white(lambda_source_t *source, size_t i) {
+    while (i != source->length && isspace(source->data[i]))
+        ++i;
+    return i;
+}
+
+/* Finds the next byte in the source at or after i which is in the structural
+ * table, the vector versions check 16 or 32 bytes at a time which quickly
+ * skips over the identifiers and whitespace which make up most of the input.
+ */
+#if defined(__AVX2__) || defined(__SSE2__)
+#   include <immintrin.h>
+#   if defined(__AVX2__)
+#       define SCAN_WIDTH           32
+#       define SCAN_VECTOR          __m256i
+#       define SCAN_LOAD(P)         _mm256_loadu_si256((const __m256i *)(P))
+#       define SCAN_SPLAT(C)        _mm256_set1_epi8(C)
+#       define SCAN_EQ(A, B)        _mm256_cmpeq_epi8((A), (B))
+#       define SCAN_OR(A, B)        _mm256_or_si256((A), (B))
+#       define SCAN_MASK(V)         (unsigned)_mm256_movemask_epi8(V)
+#   else
+#       define SCAN_WIDTH           16
+#       define SCAN_VECTOR          __m128i
+#       define SCAN_LOAD(P)         _mm_loadu_si128((const __m128i *)(P))
+#       define SCAN_SPLAT(C)        _mm_set1_epi8(C)
+#       define SCAN_EQ(A, B)        _mm_cmpeq_epi8((A), (B))
+#       define SCAN_OR(A, B)        _mm_or_si128((A), (B))
+#       define SCAN_MASK(V)         (unsigned)_mm_movemask_epi8(V)
+#   endif
+#   define SCAN_FIRST(MASK)         (size_t)__builtin_ctz(MASK)
+#   define SCAN_NEXT(MASK)          ((MASK) & ((MASK) - 1))
+#elif defined(__ARM_NEON)
+#   include <arm_neon.h>
+#   define SCAN_WIDTH               16
+#   define SCAN_VECTOR              uint8x16_t
+#   define SCAN_LOAD(P)             vld1q_u8((const uint8_t *)(P))
+#   define SCAN_SPLAT(C)            vdupq_n_u8(C)
+#   define SCAN_EQ(A, B)            vceqq_u8((A), (B))
+#   define SCAN_OR(A, B)            vorrq_u8((A), (B))
+    /* 4 bits per byte */
+#   define SCAN_MASK(V)             vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(V), 4)), 0)
+#   define SCAN_FIRST(MASK)         (size_t)(__builtin_ctzll(MASK) >> 2)
+#   define SCAN_NEXT(MASK)          ((MASK) & ~((uint64_t)0xf << (__builtin_ctzll(MASK) & ~3)))
+#endif
+
+static inline size_t parse_scan(const lambda_source_t *source, size_t i) {
+#if defined(SCAN_WIDTH)
+    /* The brackets and quotes come in pairs which only differ in a single
+     * bit, ( and ) in bit 0, [ and { as well as ] and } in bit 5, " and # in
+     * bit 0, so those are folded together before comparing.
+     */
+    const SCAN_VECTOR bit0    = SCAN_SPLAT(0x01);
+    const SCAN_VECTOR bit5    = SCAN_SPLAT(0x20);
+    const SCAN_VECTOR paren   = SCAN_SPLAT(')');
+    const SCAN_VECTOR brace   = SCAN_SPLAT('{');
+    const SCAN_VECTOR cbrace  = SCAN_SPLAT('}');
+    const SCAN_VECTOR hash    = SCAN_SPLAT('#');
+    const SCAN_VECTOR quote   = SCAN_SPLAT('\'');
+    const SCAN_VECTOR slash   = SCAN_SPLAT('/');
+    const SCAN_VECTOR semi    = SCAN_SPLAT(';');
+    const SCAN_VECTOR newline = SCAN_SPLAT('\n');
+    const size_t      nfirsts = source->keywords.nfirsts;
+    SCAN_VECTOR       first[LAMBDA_KEYWORDS_MAX];
+    for (size_t k = 0; k != nfirsts; ++k)
+        first[k] = SCAN_SPLAT(source->keywords.firsts[k]);
+    for (; i + SCAN_WIDTH <= source->length; i += SCAN_WIDTH) {
+        SCAN_VECTOR c  = SCAN_LOAD(source->data + i);
+        SCAN_VECTOR c0 = SCAN_OR(c, bit0);
+        SCAN_VECTOR c5 = SCAN_OR(c, bit5);
+        SCAN_VECTOR m  = SCAN_OR(SCAN_OR(SCAN_EQ(c0, paren), SCAN_EQ(c0, hash)),
+                                 SCAN_OR(SCAN_EQ(c5, brace), SCAN_EQ(c5, cbrace)));
+        m = SCAN_OR(m, SCAN_OR(SCAN_EQ(c, quote), SCAN_EQ(c, slash)));
+        m = SCAN_OR(m, SCAN_OR(SCAN_EQ(c, semi), SCAN_EQ(c, newline)));
+        for (size_t k = 0; k != nfirsts; ++k)
+            m = SCAN_OR(m, SCAN_EQ(c, first[k]));
+        if (SCAN_MASK(m))
+            return i + SCAN_FIRST(SCAN_MASK(m));
+    }
+#endif
+    while (i != source->length && !source->structural[(unsigned char)source->data[i]])
+        ++i;
+    return i;
+}
+
+/* Keywords are recognized at the start of a word and have to make up all of
+ * it, one at the very end of the input can't start a lambda either.
+ */
+static inline bool parse_keyword(lambda_source_t *source, size_t i) {
+    if (i && isident(source->data[i-1]))
+        return false;
+    size_t length = lambda_keywords_match(&source->keywords, source->data, source->length, i);
+    return length && i + length != source->length;
+}
+
+/* Attributes go in double brackets between the keyword and the declaration,
+ * either one per pair of brackets or as a list separated by commas.
+ */
+static const struct {
+    const char *name;
+    const char *emit;
+    const char *native; /* on a C++ lambda, which is inline already */
+} LambdaAttributes[] = {
+    { "inline",  "inline __attribute__((always_inline)) ", "__attribute__((always_inline)) " },
+    { "hot",     "__attribute__((hot)) ",                  "__attribute__((hot)) " },
+    { "cold",    "__attribute__((cold)) ",                 "__attribute__((cold)) " },
+    { "flatten", "__attribute__((flatten)) ",              "__attribute__((flatten)) " }
+};
+
+#define LAMBDA_ATTRIBUTE_INLINE 1u /* the first one */
+
+/* Returns the index after the attributes, or 0 on an error */
+static size_t parse_attributes(lambda_source_t *source, size_t i, unsigned *attributes) {
+    while (i + 1 < source->length && source->data[i] == '[' && source->data[i+1] == '[') {
+        i = parse_skip_white(source, i + 2);
+        while (true) {
+            size_t begin = i;
+            while (i != source->length && isident(source->data[i]))
+                ++i;
+            size_t a = 0;
+            for (; a != sizeof(LambdaAttributes) / sizeof(*LambdaAttributes); ++a) {
+                if (strlen(LambdaAttributes[a].name) == i - begin && !memcmp(LambdaAttributes[a].name, source->data + begin, i - begin))
+                    break;
+            }
+            if (a == sizeof(LambdaAttributes) / sizeof(*LambdaAttributes)) {
+                parse_error(source, begin, "unknown lambda attribute `%.*s'", (int)(i - begin), source->data + begin);
+                return 0;
+            }
+            *attributes |= 1u << a;
+            i = parse_skip_white(source, i);
+            if (i == source->length || source->data[i] != ',')
+                break;
+            i = parse_skip_white(source, i + 1);
+        }
+        if (i + 1 >= source->length || source->data[i] != ']' || source->data[i+1] != ']') {
+            parse_error(source, i, "expected `]]' after the lambda attributes");
+            return 0;
+        }
+        i = parse_skip_white(source, i + 2);
+    }
+    return i;
+}
+
+/* Captures go in single brackets after the attributes, each one a type and a
+ * name. A & in front of the name captures the address of the variable instead
+ * of its value, so the lambda sees a pointer to it.
+ */
+typedef struct {
+    lambda_range_t type;
+    lambda_range_t name;
+    bool           address;
+} lambda_capture_t;
+
+/* Splits off the capture at *pos, an invalid one gets an empty name */
+static bool lambda_capture_next(const char *data, size_t *pos, size_t end, lambda_capture_t *capture) {
+    size_t begin = *pos;
+    size_t last;
+    if (begin >= end)
+        return false;
+    for (last = begin; last != end && data[last] != ','; ++last)
+        ;
+    *pos = last + 1;
+
+    memset(capture, 0, sizeof(*capture));
+    while (begin != last && isspace(data[begin]))
+        ++begin;
+    while (last != begin && isspace(data[last-1]))
+        --last;
+    size_t name = last;
+    while (name != begin && isident(data[name-1]))
+        --name;
+    if (name == last || isdigit(data[name]))
+        return true;
+    size_t type = name;
+    while (type != begin && isspace(data[type-1]))
+        --type;
+    if (type != begin && data[type-1] == '&') {
+        capture->address = true;
+        --type;
+        while (type != begin && isspace(data[type-1]))
+            --type;
+    }
+    if (type == begin)
+        return true;
+    capture->type.begin  = begin;
+    capture->type.length = type - begin;
+    capture->name.begin  = name;
+    capture->name.length = last - name;
+    return true;
+}
+
+/* Returns the index after the captures, or 0 on an error */
+static size_t parse_captures(lambda_source_t *source, size_t i, lambda_range_t *captures) {
+    size_t end = i + 1;
+    while (end != source->length && source->data[end] != ']')
+        ++end;
+    if (end == source->length) {
+        parse_error(source, i, "unterminated capture list");
+        return 0;
+    }
+
+    lambda_capture_t capture;
+    size_t           pos   = i + 1;
+    size_t           count = 0;
+    while (lambda_capture_next(source->data, &pos, end, &capture)) {
+        if (!capture.name.length) {
+            parse_error(source, i, "a capture needs a type and a name");
+            return 0;
+        }
+        ++count;
+    }
+    if (!count) {
+        parse_error(source, i, "empty capture list");
+        return 0;
+    }
+    captures->begin  = i + 1;
+    captures->length = end - (i + 1);
+    return parse_skip_white(source, end + 1);
+}
+
+static size_t parse_comment(lambda_source_t *source, size_t i) {
+    if (i + 1 < source->length && source->data[i] == '/') {
+        /* the input isn't null terminated so the searches are bounded */
+        const char *end = source->data + source->length;
+        const char *find;
+        if (source->data[i+1] == '/') {
+            /* Single line comments */
+            find = (const char *)memchr(source->data + i, '\n', end - (source->data + i));
+            i = find ? (size_t)(find - source->data) : source->length;
+        } else if (source->data[i+1] == '*') {
+            /* Multi line comments */
+            for (find = source->data + i + 2; find < end; ++find) {
+                if (!(find = (const char *)memchr(find, '*', end - find)))
+                    break;
+                if (find + 1 < end && find[1] == '/')
+                    break;
+            }
+            i = (find && find < end) ? (size_t)(find + 1 - source->data) : source->length;
+        }
+    }
+    return i;
+}
+
+static inline bool parse_push(parse_data_t *data, parse_type_t type) {
+    if (!lambda_vector_resize(&data->frames))
+        return false;
+    parse_frame_t *frame = &data->frames.frames[data->frames.elements++];
+    memset(frame, 0, sizeof(*frame));
+    frame->type   = type;
+    frame->parens = data->parens.elements;
+    return true;
+}
+
+/* The parser keeps the state of every lambda it is in on an explicit stack of
+ * frames instead of recursing, and all frames share one bracket stack where
+ * each frame only looks at the brackets above the depth it started at. Lambda
+ * frames are followed by a type frame while parsing the declaration.
+ *
+ * Parsing starts at the top level at i and stops at end, which is the end of
+ * the source unless a segment of it is parsed.
+ */
+static bool parse(lambda_source_t *source, parse_data_t *data, size_t i, size_t end) {
+    lambda_vector_t *parens       = &data->parens;
+    parse_frame_t   *frame;
+    size_t           protopos     = i;
+    bool             protomove    = true;
+    bool             preprocessor = false;
+    /* The outer most frame is where we remember where to put prototypes!
+     * when protomove is true we move the protopos along whitespace so that
+     * the lambdas don't get stuck to the tail of hte previous functions.
+     * Also we need to put lambdas after #include lines so if we encounter
+     * a preprocessor directive we create another position marker starting
+     * at the nest new line
+     */
+
+    parens->elements      = 0;
+    data->frames.elements = 0;
+    if (!parse_push(data, PARSE_NORMAL))
+        goto parse_oom;
+    frame = data->frames.frames;
+
+    while (i < end) {
+        bool mark    = (data->frames.elements == 1);
+        bool nameofs = (frame->type == PARSE_TYPE);
+        bool nested  = (parens->elements != frame->parens);
+
+        /* unless we're moving the prototype position or looking for the
+         * name of a lambda only the structural bytes matter
+         */
+        if (!nameofs && !(protomove && mark && !nested)) {
+            if ((i = parse_scan(source, i)) >= end)
+                break;
+        }
+
+        if (mark && !nested) {
+            if (protomove) {
+                if (isspace(source->data[i])) {
+                    protopos = ++i;
+                    continue;
+                }
+                protomove = false;
+                if (data->stream)
+                    generate_flush(source, data, protopos);
+                if (!lambda_vector_push_offset(&data->positions, protopos))
+                    goto parse_oom;
+            }
+
+            if (source->data[i] == ';') {
+                ++i;
+                protomove = true;
+                protopos  = i;
+                continue;
+            }
+
+            if (source->data[i] == '#') {
+                ++i;
+                protomove = false;
+                protopos  = i;
+                preprocessor = true;
+                continue;
+            }
+            if (preprocessor && source->data[i] == '\n') {
+                ++i;
+                protomove = true;
+                protopos  = i;
+                preprocessor = false;
+                continue;
+            }
+        }
+
+        if (frame->movename) {
+            if (source->data[i] != '*' && source->data[i] != '(' && !isspace(source->data[i]))
+                frame->movename = false;
+            else if (source->data[i] != '(')
+                frame->nameofs = i+1;
+        }
+
+        char ch = source->data[i];
+        if (ch == '"' || ch == '\'') {
+            i = parse_skip_string(source, i+1, ch);
+        } else if (ch == '(' || ch == '[' || ch == '{') {
+            if (nameofs && !nested) {
+                if (frame->expectbody && ch == '{')
+                    goto finish_type;
+                if (!frame->expectbody && ch == '(') {
+                    frame->expectbody = true;
+                    frame->movename = true;
+                    frame->nameofs = i;
+                }
+            }
+            if (!lambda_vector_push_char(parens, ch == '(' ? ')' : ch == '[' ? ']' : '}'))
+                goto parse_oom;
+            ++i;
+        } else if (ch == ')' || ch == ']' || ch == '}') {
+            if (!nested) {
+                parse_error(source, i, "too many closing parenthesis");
+                goto parse_error;
+            }
+            char back = parens->chars[parens->elements - 1];
+            if (ch != back) {
+                parse_error(source, i, "mismatching `%c' and `%c'", back, ch);
+                goto parse_error;
+            }
+            parens->elements--;
+            if (ch == '}' && parens->elements == frame->parens) {
+                if (frame->type == PARSE_LAMBDA)
+                    goto finish_lambda;
+                else if (nameofs) {
+                    if (!frame->expectbody)
+                        frame->movename = true;
+                }
+            }
+            ++i;
+            if (mark && ch == '}' && parens->elements == frame->parens) {
+                protopos = i;
+                protomove = true;
+            }
+        } else if (!isident(ch)) {
+            if (!nameofs)
+                i = parse_comment(source, i);
+            if (!nested) {
+                if (frame->type == PARSE_LAMBDA_EXPRESSION && source->data[i] == ';')
+                    goto finish_lambda;
+                if (source->short_enabled) {
+                    if (nameofs && frame->expectbody && i + 1 < source->length && source->data[i] == '=' && source->data[i+1] == '>')
+                        goto finish_type;
+                }
+            }
+            ++i;
+        } else {
+            if (!nameofs && parse_keyword(source, i)) {
+                size_t lambda;
+                if (!parse_create_lambda(data, i, &lambda))
+                    goto parse_oom;
+                if (!parse_push(data, PARSE_LAMBDA) || !parse_push(data, PARSE_TYPE))
+                    goto parse_oom;
+                frame = &data->frames.frames[data->frames.elements - 1];
+                frame[-1].lambda = lambda;
+                /* below the lambda and its type frame are the enclosing lambdas */
+                if (data->frames.elements - 2 > data->depth)
+                    data->depth = data->frames.elements - 2;
+
+                lambda_t *l = &data->lambdas.funcs[lambda];
+                while (isident(source->data[i]))
+                    ++i;
+                i = parse_skip_white(source, i);
+                if (i != source->length && source->data[i] == '[' && !(i = parse_attributes(source, i, &l->attributes)))
+                    goto parse_error;
+                if (i != source->length && source->data[i] == '[' && !(i = parse_captures(source, i, &l->captures)))
+                    goto parse_error;
+                l->decl.begin = i;
+                continue;
+            }
+            ++i;
+        }
+        continue;
+
+finish_type:
+        /* the declaration ends at the body, back to the lambda */
+        {
+            size_t ofs = frame->nameofs;
+            frame = &data->frames.frames[--data->frames.elements - 1];
+
+            lambda_t *l = &data->lambdas.funcs[frame->lambda];
+            l->name_offset = ofs - l->decl.begin;
+            l->decl.length = i - l->decl.begin;
+            l->body.begin = i;
+            i = parse_skip_white(source, i);
+            if (source->short_enabled) {
+                if (i + 1 < source->length && source->data[i] == '=' && source->data[i+1] == '>') {
+                    l->body.begin = i += 2;
+                    l->is_short = true;
+                    frame->type = PARSE_LAMBDA_EXPRESSION;
+                }
+            }
+        }
+        continue;
+
+finish_lambda:
+        {
+            lambda_t *l = &data->lambdas.funcs[frame->lambda];
+            l->body.length = i - l->body.begin;
+            frame = &data->frames.frames[--data->frames.elements - 1];
+
+            /* a short lambda may end the one it is the body of */
+            if (parens->elements == frame->parens && frame->type == PARSE_LAMBDA_EXPRESSION && source->data[i] == ';')
+                goto finish_lambda;
+            ++i;
+        }
+    }
+
+    /* a segment has to end in the state the next one starts in */
+    if (end != source->length) {
+        data->boundary = i == end && protomove && protopos == end && !preprocessor
+                      && data->frames.elements == 1 && !parens->elements;
+        return true;
+    }
+    if (data->frames.elements != 1) {
+        /* at the innermost lambda which is still open */
+        size_t f = data->frames.elements - 1;
+        while (data->frames.frames[f].type != PARSE_LAMBDA && data->frames.frames[f].type != PARSE_LAMBDA_EXPRESSION)
+            --f;
+        parse_error(source, data->starts.offsets[data->frames.frames[f].lambda], "unterminated lambda");
+        return false;
+    }
+    return true;
+
+parse_oom:
+    parse_error(source, i, "out of memory");
+parse_error:
+    return false;
+}
+
+/* Large sources can be parsed in segments on multiple threads. A segment
+ * starts at the beginning of a line which follows a `;' or a `}' and starts a
+ * new declaration, where the parser of the whole source would normally be at
+ * the top level with nothing open. The segment before has to end in exactly
+ * that state, when any of them doesn't, or one fails, the source is parsed
+ * again in one piece so that the output and the errors are the same.
+ */
+#define LAMBDA_SEGMENT_MIN  (1 << 20)
+#define LAMBDA_SEGMENTS_MAX 64
+
+typedef struct {
+    lambda_source_t source;
+    parse_data_t   *data;
+    parse_data_t    own;
+    lambda_arena_t  arena;
+    size_t          begin;
+    size_t          end;
+    bool            parsed;
+    bool            started;
+    pthread_t       thread;
+} parse_segment_t;
+
+/* Returns the first boundary at or after i, or end when there is none */
+static size_t parse_boundary(const lambda_source_t *source, size_t i, size_t end) {
+    const char *data = source->data;
+    while (i < end) {
+        const char *newline = (const char *)memchr(data + i, '\n', end - i);
+        if (!newline)
+            break;
+        i = newline - data + 1;
+        if (i == end || !(isident(data[i]) || data[i] == '#'))
+            continue;
+        size_t back = newline - data;
+        while (back && isspace(data[back-1]))
+            --back;
+        if (back && (data[back-1] == ';' || data[back-1] == '}'))
+            return i;
+    }
+    return end;
+}
+
+static void *parse_segment(void *argument) {
+    parse_segment_t *segment = (parse_segment_t *)argument;
+    if (segment->data == &segment->own && !parse_data_init(&segment->own, &segment->arena))
+        return NULL;
+    segment->parsed = parse(&segment->source, segment->data, segment->begin, segment->end);
+    return NULL;
+}
+
+/* Appends the lambdas and positions of a segment to the ones before it */
+static bool parse_merge(parse_data_t *data, const parse_data_t *segment) {
+    for (size_t l = 0; l != segment->lambdas.elements; ++l) {
+        size_t idx;
+        if (!parse_create_lambda(data, segment->starts.offsets[l], &idx))
+            return false;
+        data->lambdas.funcs[idx] = segment->lambdas.funcs[l];
+    }
+    for (size_t p = 0; p != segment->positions.elements; ++p) {
+        if (!lambda_vector_push_offset(&data->positions, segment->positions.offsets[p]))
+            return false;
+    }
+    if (segment->depth > data->depth)
+        data->depth = segment->depth;
+    return true;
+}
+
+static bool parse_segments(lambda_source_t *source, parse_data_t *data) {
+    parse_segment_t segments[LAMBDA_SEGMENTS_MAX];
+    size_t          count = source->length / LAMBDA_SEGMENT_MIN;
+
+    if (count > source->jobs)
+        count = source->jobs;
+    if (count > LAMBDA_SEGMENTS_MAX)
+        count = LAMBDA_SEGMENTS_MAX;
+
+    /* segments of about the same size, a boundary at the end means fewer */
+    size_t begin = 0;
+    size_t used  = 0;
+    while (used < count && begin < source->length) {
+        size_t end = used + 1 == count ? source->length
+                   : parse_boundary(source, begin + (source->length - begin) / (count - used), source->length);
+        parse_segment_t *segment = &segments[used++];
+        memset(segment, 0, sizeof(*segment));
+        segment->source         = *source;
+        segment->source.error   = -1;
+        segment->source.message = NULL;
+        segment->source.stats   = NULL;
+        segment->data           = used == 1 ? data : &segment->own;
+        segment->begin          = begin;
+        segment->end            = end;
+        lambda_arena_init(&segment->arena);
+        begin = end;
+    }
+    /* the calling thread parses the first segment, and any which didn't get
+     * a thread of their own
+     */
+    bool merged = false;
+    if (used > 1) {
+        for (size_t s = 1; s != used; ++s)
+            segments[s].started = !pthread_create(&segments[s].thread, NULL, &parse_segment, &segments[s]);
+        parse_segment(&segments[0]);
+        for (size_t s = 1; s != used; ++s) {
+            if (segments[s].started)
+                pthread_join(segments[s].thread, NULL);
+            else
+                parse_segment(&segments[s]);
+        }
+
+        merged = segments[0].parsed;
+        for (size_t s = 1; merged && s != used; ++s)
+            merged = segments[s - 1].data->boundary && segments[s].parsed && parse_merge(data, segments[s].data);
+    }
+    for (size_t s = 0; s != used; ++s)
+        lambda_arena_destroy(&segments[s].arena);
+    if (merged)
+        return true;
+
+    data->lambdas.elements   = 0;
+    data->starts.elements    = 0;
+    data->positions.elements = 0;
+    data->depth              = 0;
+    return parse(source, data, 0, source->length);
+}
+
+/* Output */
+lambda_output_t *output_create(void) {
+    return (lambda_output_t *)calloc(1, sizeof(lambda_output_t));
+}
+
+void output_destroy(lambda_output_t *out) {
+    if (out)
+        free(out->capture);
+    free(out);
+}
+
+void output_init(lambda_output_t *out, int fd) {
+    out->fd        = fd;
+    out->count     = 0;
+    out->used      = 0;
+    out->written   = 0;
+    out->markers   = 0;
+    out->bol       = true;
+    out->counting  = false;
+    out->line      = 0;
+    out->error     = 0;
+    out->sink      = NULL;
+    out->user      = NULL;
+    out->capturing = false;
+    out->captured  = 0;
+}
+
+/* The capture buffer is kept across translations, failing to grow it only
+ * stops capturing.
+ */
+static void output_capture(lambda_output_t *out) {
+    size_t length = 0;
+    for (int i = 0; i != out->count; ++i)
+        length += out->iov[i].iov_len;
+    if (out->captured + length > out->capacity) {
+        size_t request = out->capacity ? out->capacity : 4096;
+        while (request < out->captured + length)
+            request *= 2;
+        char *temp = (char *)realloc(out->capture, request);
+        if (!temp) {
+            out->capturing = false;
+            return;
+        }
+        out->capture  = temp;
+        out->capacity = request;
+    }
+    for (int i = 0; i != out->count; ++i) {
+        memcpy(out->capture + out->captured, out->iov[i].iov_base, out->iov[i].iov_len);
+        out->captured += out->iov[i].iov_len;
+    }
+}
+
+static bool output_flush(lambda_output_t *out) {
+    struct iovec *iov   = out->iov;
+    int           count = out->count;
+    if (out->capturing)
+        output_capture(out);
+    for (; count && out->sink && !out->error; ++iov, --count) {
+        if (!out->sink(out->user, (const char *)iov->iov_base, iov->iov_len))
+            out->error = ECANCELED;
+        else
+            out->written += iov->iov_len;
+    }
+    while (count && !out->error) {
+        ssize_t wrote = writev(out->fd, iov, count);
+        if (wrote < 0) {
+            if (errno != EINTR)
+                out->error = errno;
+            continue;
+        }
+        out->written += wrote;
+        for (; count && (size_t)wrote >= iov->iov_len; ++iov, --count)
+            wrote -= iov->iov_len;
+        if (count) {
+            iov->iov_base  = (char *)iov->iov_base + wrote;
+            iov->iov_len  -= wrote;
+        }
+    }
+    out->count = 0;
+    out->used  = 0;
+    return !out->error;
+}
+
+/* Slices have to stay valid until the next flush. */
+static inline void output_slice(lambda_output_t *out, const char *data, size_t length) {
+    if (!length)
+        return;
+    out->bol = data[length-1] == '\n';
+    if (out->counting) {
+        const char *end = data + length;
+        for (const char *find = data; (find = (const char *)memchr(find, '\n', end - find)); ++find)
+            out->line++;
+    }
+    if (out->count) {
+        struct iovec *last = &out->iov[out->count - 1];
+        if ((char *)last->iov_base + last->iov_len == data) {
+            last->iov_len += length;
+            return;
+        }
+    }
+    if (out->count == LAMBDA_OUTPUT_IOVECS)
+        output_flush(out);
+    out->iov[out->count].iov_base = (void *)data;
+    out->iov[out->count].iov_len  = length;
+    out->count++;
+}
+
+static inline void output_text(lambda_output_t *out, const char *text, size_t length) {
+    /* flushing resets the scratch buffer so it can't happen in output_slice() */
+    if (out->used + length > sizeof(out->scratch) || out->count == LAMBDA_OUTPUT_IOVECS)
+        output_flush(out);
+    if (length > sizeof(out->scratch)) {
+        output_slice(out, text, length);
+        output_flush(out);
+        return;
+    }
+    memcpy(out->scratch + out->used, text, length);
+    output_slice(out, out->scratch + out->used, length);
+    out->used += length;
+}
+
+static inline void output_string(lambda_output_t *out, const char *text) {
+    output_text(out, text, strlen(text));
+}
+
+static inline void output_number(lambda_output_t *out, size_t number) {
+    char  buffer[32];
+    char *digit = buffer + sizeof(buffer);
+    do
+        *--digit = '0' + number % 10;
+    while (number /= 10);
+    output_text(out, digit, buffer + sizeof(buffer) - digit);
+}
+
+/* Lines */
+#define LAMBDA_LINES_CHUNK (64 << 10)
+
+/* Indexes the newlines up to at least offset upto */
+static bool lambda_lines_extend(parse_data_t *data, const lambda_source_t *source, size_t upto) {
+    lambda_vector_t *newlines = &data->newlines;
+    size_t           i        = data->indexed;
+    size_t           end      = upto + LAMBDA_LINES_CHUNK < source->length ? upto + LAMBDA_LINES_CHUNK : source->length;
+    const char      *text     = source->data;
+#if defined(SCAN_WIDTH)
+    const SCAN_VECTOR newline = SCAN_SPLAT('\n');
+    for (; i + SCAN_WIDTH <= end; i += SCAN_WIDTH) {
+        for (uint64_t mask = SCAN_MASK(SCAN_EQ(SCAN_LOAD(text + i), newline)); mask; mask = SCAN_NEXT(mask)) {
+            if (!lambda_vector_resize(newlines))
+                return false;
+            newlines->offsets[newlines->elements++] = i + SCAN_FIRST(mask);
+        }
+    }
+#endif
+    for (; i != end; ++i) {
+        if (text[i] == '\n') {
+            if (!lambda_vector_resize(newlines))
+                return false;
+            newlines->offsets[newlines->elements++] = i;
+        }
+    }
+    data->indexed = end;
+    return true;
+}
+
+/* Line numbers are only needed for the markers, so the index of the newlines
+ * they come from is built as far as they are asked for.
+ */
+static size_t lambda_line(parse_data_t *data, const lambda_source_t *source, size_t pos) {
+    if (!pos)
+        return 1;
+    if (pos >= data->indexed && pos < source->length && !lambda_lines_extend(data, source, pos)) {
+        data->failed = true;
+        return 1;
+    }
+    const lambda_offset_t *offsets = data->newlines.offsets;
+    size_t                 line    = 0;
+    size_t                 count   = data->newlines.elements;
+    while (count) {
+        size_t half = count / 2;
+        if (offsets[line + half] < pos) {
+            line  += half + 1;
+            count -= half + 1;
+        } else
+            count = half;
+    }
+    return line + 1;
+}
+
+/* Generator */
+/* Marks the output as coming from the line of the source offset pos, data
+ * can be NULL for the start.
+ */
+static inline void generate_marker(lambda_output_t *out, lambda_source_t *source, parse_data_t *data, size_t pos, bool newline) {
+    if (source->markers != LAMBDA_MARKERS_ALL) {
+        /* a marker has to start a line, which might be the one the compiler
+         * expects next anyway
+         */
+        if (newline && !out->bol)
+            output_text(out, "\n", 1);
+        newline = false;
+        if (source->markers == LAMBDA_MARKERS_NONE)
+            return;
+    }
+    size_t line = lambda_line(data, source, pos);
+    if (source->markers == LAMBDA_MARKERS_CHANGED && out->line == line)
+        return;
+    out->markers++;
+    if (newline)
+        output_text(out, "\n", 1);
+    output_text(out, "#line ", 6);
+    output_number(out, line);
+    output_text(out, " \"", 2);
+    output_string(out, source->file);
+    output_text(out, "\"\n", 2);
+    out->line = line;
+}
+
+static void cache_hash(const void *key, size_t length, uint32_t seed, uint64_t out[2]);
+
+/* The text of a lambda which has to be the same for it to keep its name */
+static inline size_t lambda_text(const lambda_t *lambda, size_t *length) {
+    size_t begin = lambda->captures.length ? lambda->captures.begin : lambda->decl.begin;
+    *length = lambda->body.begin + lambda->body.length + 1 - begin;
+    return begin;
+}
+
+static lambda_name_t *generate_names_find(const parse_data_t *data, uint64_t hash) {
+    size_t slot = hash & (data->names_size - 1);
+    while (data->names[slot].count && data->names[slot].hash != hash)
+        slot = (slot + 1) & (data->names_size - 1);
+    return &data->names[slot];
+}
+
+/* Stable names only change along with the text of the lambda: lambda_<hash>,
+ * where lambdas with the same text get the number of the ones before them
+ * appended. The hashes of everything already written are kept so that this
+ * works in streaming mode as well.
+ */
+static bool generate_names(parse_data_t *data, const lambda_source_t *source) {
+    for (size_t lam = 0; lam != data->lambdas.elements; ++lam) {
+        lambda_t *lambda = &data->lambdas.funcs[lam];
+        uint64_t  hash[2];
+        size_t    length;
+        size_t    begin = lambda_text(lambda, &length);
+
+        if (data->names_used * 2 >= data->names_size) {
+            size_t         size  = data->names_size ? data->names_size * 2 : 64;
+            lambda_name_t *names = (lambda_name_t *)lambda_arena_alloc(data->arena, size * sizeof(*names));
+            if (!names)
+                return false;
+            memset(names, 0, size * sizeof(*names));
+            for (size_t i = 0; i != data->names_size; ++i) {
+                size_t slot = data->names[i].hash & (size - 1);
+                if (!data->names[i].count)
+                    continue;
+                while (names[slot].count)
+                    slot = (slot + 1) & (size - 1);
+                names[slot] = data->names[i];
+            }
+            data->names      = names;
+            data->names_size = size;
+        }
+
+        cache_hash(source->data + begin, length, lambda->attributes, hash);
+        lambda_name_t *name = generate_names_find(data, hash[0]);
+        if (!name->count) {
+            name->hash = hash[0];
+            data->names_used++;
+        }
+        lambda->hash = hash[0];
+        lambda->same = name->count++;
+    }
+    return true;
+}
+
+/* A lambda reuses the function of an identical one which was emitted before
+ * it, so this has to see the lambdas in the order they are written out. The
+ * shared function goes without the number of identical lambdas in its name.
+ */
+static void generate_dedupe(parse_data_t *data, const lambda_source_t *source, size_t lam) {
+    lambda_t      *lambda = &data->lambdas.funcs[lam];
+    lambda_name_t *name   = generate_names_find(data, lambda->hash);
+    size_t         length;
+    size_t         begin  = lambda_text(lambda, &length);
+    if (!name->emitted) {
+        name->emitted    = true;
+        name->begin      = begin;
+        name->length     = length;
+        name->attributes = lambda->attributes;
+        name->number     = data->lambda_base + lam;
+        name->same       = lambda->same = 0;
+    } else if (name->length == length && name->attributes == lambda->attributes && !memcmp(source->data + name->begin, source->data + begin, length)) {
+        lambda->duplicate = true;
+        lambda->number    = name->number;
+        lambda->same      = name->same;
+    }
+}
+
+static inline void generate_name(lambda_output_t *out, const lambda_source_t *source, const parse_data_t *data, size_t lam) {
+    output_text(out, "lambda_", 7);
+    if (source->prefix) {
+        output_text(out, source->prefix, strlen(source->prefix));
+        output_text(out, "_", 1);
+    }
+    if (!source->stable_names) {
+        const lambda_t *lambda = &data->lambdas.funcs[lam];
+        output_number(out, lambda->duplicate ? lambda->number : data->lambda_base + lam);
+        return;
+    }
+
+    const lambda_t *lambda = &data->lambdas.funcs[lam];
+    char            hex[16];
+    for (size_t i = 0; i != sizeof(hex); ++i)
+        hex[i] = "0123456789abcdef"[(lambda->hash >> (60 - 4 * i)) & 15];
+    output_text(out, hex, sizeof(hex));
+    if (lambda->same) {
+        output_text(out, "_", 1);
+        output_number(out, lambda->same);
+    }
+}
+
+/* A lambda with captures gets a struct of them declared right before it */
+static void generate_environment(lambda_output_t *out, lambda_source_t *source, const parse_data_t *data, size_t idx) {
+    const lambda_t  *lambda = &data->lambdas.funcs[idx];
+    lambda_capture_t capture;
+    size_t           pos = lambda->captures.begin;
+    output_text(out, "struct ", 7);
+    generate_name(out, source, data, idx);
+    output_text(out, "_env {", 6);
+    while (lambda_capture_next(source->data, &pos, lambda->captures.begin + lambda->captures.length, &capture)) {
+        output_text(out, " ", 1);
+        output_slice(out, source->data + capture.type.begin, capture.type.length);
+        output_text(out, capture.address ? " *" : " ", capture.address ? 2 : 1);
+        output_slice(out, source->data + capture.name.begin, capture.name.length);
+        output_text(out, ";", 1);
+    }
+    output_text(out, " }; ", 4);
+}
+
+/* The environment is a pointer appended to the parameters, the captures are
+ * copied out of it at the start of the body.
+ */
+static void generate_parameters(lambda_output_t *out, lambda_source_t *source, const lambda_t *lambda) {
+    const char *decl  = source->data + lambda->decl.begin;
+    size_t      begin = lambda->name_offset;
+    size_t      end   = lambda->decl.length;
+    size_t      open  = begin;
+    while (open != end && decl[open] != '(')
+        ++open;
+    size_t close = open + 1, depth = 1;
+    for (; close < end; ++close) {
+        if (decl[close] == '(')
+            ++depth;
+        else if (decl[close] == ')' && !--depth)
+            break;
+    }
+    if (close >= end) {
+        output_slice(out, decl + begin, end - begin);
+        return;
+    }
+
+    size_t first = open + 1, last = close;
+    while (first != last && isspace(decl[first]))
+        ++first;
+    while (last != first && isspace(decl[last-1]))
+        --last;
+    if (first == last || (last - first == 4 && !memcmp(decl + first, "void", 4))) {
+        output_slice(out, decl + begin, open + 1 - begin);
+        output_text(out, "void *lambda_env", 16);
+    } else {
+        output_slice(out, decl + begin, close - begin);
+        output_text(out, ", void *lambda_env", 18);
+    }
+    output_slice(out, decl + close, end - close);
+}
+
+static void generate_captures(lambda_output_t *out, lambda_source_t *source, const parse_data_t *data, size_t idx) {
+    const lambda_t  *lambda = &data->lambdas.funcs[idx];
+    lambda_capture_t capture;
+    size_t           pos = lambda->captures.begin;
+    while (lambda_capture_next(source->data, &pos, lambda->captures.begin + lambda->captures.length, &capture)) {
+        output_text(out, " ", 1);
+        output_slice(out, source->data + capture.type.begin, capture.type.length);
+        output_text(out, capture.address ? " *" : " ", capture.address ? 2 : 1);
+        output_slice(out, source->data + capture.name.begin, capture.name.length);
+        output_text(out, " = ((struct ", 12);
+        generate_name(out, source, data, idx);
+        output_text(out, "_env *)lambda_env)->", 20);
+        output_slice(out, source->data + capture.name.begin, capture.name.length);
+        output_text(out, ";", 1);
+    }
+}
+
+/* At the use site the lambda turns into two arguments, the function and its
+ * environment as a compound literal on the stack of the caller.
+ */
+static void generate_environment_use(lambda_output_t *out, lambda_source_t *source, const parse_data_t *data, size_t idx) {
+    const lambda_t  *lambda = &data->lambdas.funcs[idx];
+    lambda_capture_t capture;
+    size_t           pos   = lambda->captures.begin;
+    bool             first = true;
+    output_text(out, ", &(struct ", 11);
+    generate_name(out, source, data, idx);
+    output_text(out, "_env){", 6);
+    while (lambda_capture_next(source->data, &pos, lambda->captures.begin + lambda->captures.length, &capture)) {
+        output_text(out, first ? " ." : ", .", first ? 2 : 3);
+        output_slice(out, source->data + capture.name.begin, capture.name.length);
+        output_text(out, capture.address ? " = &" : " = ", capture.address ? 4 : 3);
+        output_slice(out, source->data + capture.name.begin, capture.name.length);
+        first = false;
+    }
+    output_text(out, " }", 2);
+}
+
+static inline void generate_begin(lambda_output_t *out, lambda_source_t *source, parse_data_t *data, size_t idx) {
+    const lambda_t *lambda = &data->lambdas.funcs[idx];
+    generate_marker(out, source, data, lambda->decl.begin, true);
+    if (lambda->captures.length)
+        generate_environment(out, source, data, idx);
+    output_text(out, "static ", 7);
+    if (source->inline_all && !(lambda->attributes & LAMBDA_ATTRIBUTE_INLINE))
+        output_text(out, "inline ", 7);
+    for (size_t a = 0; a != sizeof(LambdaAttributes) / sizeof(*LambdaAttributes); ++a) {
+        if (lambda->attributes & (1u << a))
+            output_string(out, LambdaAttributes[a].emit);
+    }
+    size_t ofs = lambda->name_offset;
+    output_slice(out, source->data + lambda->decl.begin, ofs);
+    output_text(out, " ", 1);
+    generate_name(out, source, data, idx);
+    if (lambda->captures.length)
+        generate_parameters(out, source, lambda);
+    else
+        output_slice(out, source->data + lambda->decl.begin+ofs, lambda->decl.length-ofs);
+}
+
+/* Both tables are sorted by offset since the parser appends to them in order,
+ * so ranges in them are found by binary search. These return the first entry
+ * at or after the given index which is at or after pos.
+ */
+static size_t lambda_bound(const parse_data_t *data, size_t lam, size_t pos) {
+    size_t count = data->lambdas.elements - lam;
+    while (count) {
+        size_t half = count / 2;
+        if (data->starts.offsets[lam + half] < pos) {
+            lam   += half + 1;
+            count -= half + 1;
+        } else
+            count = half;
+    }
+    return lam;
+}
+
+static size_t position_bound(const parse_data_t *data, size_t proto, size_t pos) {
+    size_t count = data->positions.elements - proto;
+    while (count) {
+        size_t half = count / 2;
+        if (data->positions.offsets[proto + half] < pos) {
+            proto += half + 1;
+            count -= half + 1;
+        } else
+            count = half;
+    }
+    return proto;
+}
+
+static size_t next_prototype_position(parse_data_t *data, size_t lam, size_t proto) {
+    if (lam == data->lambdas.elements)
+        return data->positions.elements;
+    if (proto > data->positions.elements)
+        proto = data->positions.elements;
+    return position_bound(data, proto, data->starts.offsets[lam] + 1) - 1;
+}
+
+static void generate_code(lambda_output_t *out, lambda_source_t *source, size_t pos, size_t len, parse_data_t *data, size_t lam, bool source_only);
+
+/* With cxx a lambda becomes a C++ lambda in place, which templates can inline
+ * and which still decays to a function pointer where one is needed. That
+ * takes a declaration of a return type followed by just the parameters, and
+ * no captures, which are passed as the extra argument of a plain function.
+ */
+static bool lambda_native(const lambda_source_t *source, const lambda_t *lambda) {
+    if (!source->cxx || lambda->captures.length)
+        return false;
+    const char *decl  = source->data + lambda->decl.begin;
+    size_t      open  = lambda->name_offset;
+    size_t      end   = lambda->decl.length;
+    size_t      depth = 0;
+    while (open != end && isspace(decl[open]))
+        ++open;
+    if (!open || open == end || decl[open] != '(')
+        return false;
+    for (size_t i = open; i != end; ++i) {
+        if (decl[i] == '(')
+            ++depth;
+        else if (decl[i] == ')' && !--depth) {
+            while (++i != end && isspace(decl[i]))
+                ;
+            return i == end;
+        }
+    }
+    return false;
+}
+
+static void generate_native(lambda_output_t *out, lambda_source_t *source, parse_data_t *data, size_t lam) {
+    const lambda_t *lambda = &data->lambdas.funcs[lam];
+    const char     *decl   = source->data + lambda->decl.begin;
+    size_t          ofs    = lambda->name_offset;
+    size_t          ret    = ofs;
+    while (ret && isspace(decl[ret-1]))
+        --ret;
+
+    size_t end = lambda->decl.length;
+    while (end > ofs && isspace(decl[end-1]))
+        --end;
+
+    output_text(out, "([]", 3);
+    output_slice(out, decl + ofs, end - ofs);
+    output_text(out, " ", 1);
+    for (size_t a = 0; a != sizeof(LambdaAttributes) / sizeof(*LambdaAttributes); ++a) {
+        if (lambda->attributes & (1u << a))
+            output_string(out, LambdaAttributes[a].native);
+    }
+    output_text(out, "-> ", 3);
+    output_slice(out, decl, ret);
+
+    /* whatever is between the declaration and the body, without the => */
+    size_t gap = lambda->decl.begin + end;
+    if (lambda->is_short) {
+        size_t arrow = gap;
+        while (arrow + 1 < lambda->body.begin && memcmp(source->data + arrow, "=>", 2))
+            ++arrow;
+        output_slice(out, source->data + gap, arrow - gap);
+        output_text(out, arrow == gap ? " {" : "{", arrow == gap ? 2 : 1);
+        gap = arrow + 2 < lambda->body.begin ? arrow + 2 : lambda->body.begin;
+    } else if (gap == lambda->body.begin)
+        output_text(out, " ", 1);
+    output_slice(out, source->data + gap, lambda->body.begin - gap);
+    generate_code(out, source, lambda->body.begin, lambda->body.length + 1, data, lam + 1, true);
+    output_text(out, lambda->is_short ? "})" : ")", lambda->is_short ? 2 : 1);
+}
+
+/* Returns whether there were any functions to write */
+static bool generate_functions(lambda_output_t *out, lambda_source_t *source, parse_data_t *data, size_t lam, size_t proto) {
+    size_t first   = lam;
+    bool   written = false;
+    if ((proto+1) == data->positions.elements)
+        lam = data->lambdas.elements;
+    else
+        lam = lambda_bound(data, lam, data->positions.offsets[proto+1] + 1);
+    if (source->dedupe)
+        for (size_t l = lam; l-- != first; )
+            generate_dedupe(data, source, l);
+    while (lam-- != first) {
+        lambda_t *lambda = &data->lambdas.funcs[lam];
+        if (lambda->duplicate || lambda_native(source, lambda))
+            continue;
+        generate_begin(out, source, data, lam);
+        written = true;
+        /* the captures go right after the opening brace */
+        size_t brace = !lambda->is_short && lambda->captures.length;
+        if (lambda->is_short || brace)
+            output_text(out, "{", 1);
+        if (lambda->captures.length)
+            generate_captures(out, source, data, lam);
+        generate_code(out, source, lambda->body.begin + brace, lambda->body.length + 1 - brace, data, lam + 1, true);
+        if (lambda->is_short)
+            output_text(out, "}", 1);
+    }
+    if (written)
+        output_text(out, "\n", 1);
+    return written;
+}
+
+/* when generating the actual code we also take prototype-positioning into account */
+static void generate_code(lambda_output_t *out, lambda_source_t *source, size_t pos, size_t len, parse_data_t *data, size_t lam, bool source_only) {
+    /* we know that positions always has at least 1 element, the 0, so the first search is there */
+    size_t proto  = source_only ? data->positions.elements : next_prototype_position(data, lam, 1);
+    size_t resync = data->positions.elements;
+    bool   moved  = !source_only && data->resync;
+    /* in streaming mode the statement after the lambda begins the next region */
+    if (moved && resync)
+        resync = 0;
+    if (!source_only)
+        data->resync = false;
+    while (len) {
+        /* the lines of a lambda which was replaced are missing from the
+         * output, the next top-level statement gets a marker if there isn't
+         * a lambda before it
+         */
+        if (resync < data->positions.elements) {
+            size_t point = data->positions.offsets[resync];
+            if (resync != proto && point <= pos + len && (lam == data->lambdas.elements || point <= data->starts.offsets[lam])) {
+                output_slice(out, source->data + pos, point - pos);
+                generate_marker(out, source, data, point, true);
+                len  -= point - pos;
+                pos   = point;
+                moved = false;
+            }
+            resync = data->positions.elements;
+        }
+
+        if (proto != data->positions.elements) {
+            size_t point = data->positions.offsets[proto];
+            if (pos <= point && pos+len >= point) {
+                /* we insert prototypes here! */
+                size_t length = point - pos;
+                output_slice(out, source->data + pos, length);
+                if (generate_functions(out, source, data, lam, proto)) {
+                    generate_marker(out, source, data, point, true);
+                    moved = false;
+                }
+                len -= length;
+                pos += length;
+            }
+        }
+
+        if (lam == data->lambdas.elements || data->starts.offsets[lam] > pos + len) {
+            output_slice(out, source->data + pos, len);
+            return;
+        }
+
+        lambda_t *lambda = &data->lambdas.funcs[lam];
+        size_t    length = lambda->body.begin + lambda->body.length + 1 - pos;
+
+        output_slice(out, source->data + pos, data->starts.offsets[lam] - pos);
+        if (lambda_native(source, lambda))
+            generate_native(out, source, data, lam);
+        else {
+            output_text(out, "(&", 2);
+            generate_name(out, source, data, lam);
+            output_text(out, ")", 1);
+            if (lambda->captures.length)
+                generate_environment_use(out, source, data, lam);
+        }
+
+        len -= length;
+        pos += length;
+
+        /* only a lambda spanning lines leaves any of them out */
+        if (!source_only && !moved && source->markers != LAMBDA_MARKERS_NONE)
+            moved = lambda_line(data, source, data->starts.offsets[lam]) != lambda_line(data, source, pos);
+        if (moved) {
+            resync = position_bound(data, proto < data->positions.elements ? proto : 0, pos);
+            data->resync = data->stream && resync == data->positions.elements;
+        }
+        lam = lambda_bound(data, lam + 1, pos);
+        proto = next_prototype_position(data, lam, proto);
+    }
+}
+
+
+/* In streaming mode the parser calls this whenever it starts a new top-level
+ * statement: everything before it is final, so it gets written out and the
+ * lambdas and positions collected for it are dropped.
+ */
+static void generate_flush(lambda_source_t *source, parse_data_t *data, size_t upto) {
+    static const size_t release = 1 << 20;
+
+    if ((source->stable_names || source->dedupe) && !data->failed && !generate_names(data, source)) {
+        parse_error(source, source->length, "out of memory");
+        data->failed = true;
+    }
+    generate_code(data->stream, source, data->flushed, upto - data->flushed, data, 0, false);
+
+    data->lambda_base        += data->lambdas.elements;
+    data->positions_flushed  += data->positions.elements;
+    data->lambdas.elements    = 0;
+    data->starts.elements     = 0;
+    data->positions.elements  = 0;
+    data->flushed             = upto;
+
+    /* the parser never looks back past a flushed region */
+    if (source->mapped && upto - data->released >= release && output_flush(data->stream)) {
+        size_t page = (size_t)sysconf(_SC_PAGESIZE);
+        size_t end  = upto & ~(page - 1);
+        madvise((char *)source->data + data->released, end - data->released, MADV_DONTNEED);
+        data->released = end;
+    }
+}
+
+/* Leaves the parse data for the caller to look at, the arena still has to be
+ * reset afterwards.
+ */
+static bool generate_data(lambda_output_t *out, lambda_source_t *source, parse_data_t *data, bool stream) {
+    bool success = false;
+
+#ifndef LAMBDAPP_LARGE_FILES
+    if (source->length > LAMBDA_OFFSET_MAX) {
+        parse_error(source, 0, "file too large, lambdapp has to be built with LAMBDAPP_LARGE_FILES for it");
+        return false;
+    }
+#endif
+
+    out->counting = source->markers == LAMBDA_MARKERS_CHANGED;
+    if (stream) {
+        data->stream = out;
+        generate_marker(out, source, data, 0, false);
+    }
+
+    lambda_stats_t *stats = source->stats;
+    if (stats)
+        stats->parse.begin = lambda_clock();
+    bool parsed = !stream && source->jobs > 1 ? parse_segments(source, data) : parse(source, data, 0, source->length);
+    if (stats) {
+        stats->parse.duration = lambda_clock() - stats->parse.begin;
+        stats->lambdas        = data->lambda_base + data->lambdas.elements;
+        stats->positions      = data->positions_flushed + data->positions.elements;
+        stats->depth          = data->depth;
+    }
+    if (!parsed)
+        goto generate_done;
+
+    if ((source->stable_names || source->dedupe) && !data->failed && !generate_names(data, source)) {
+        parse_error(source, source->length, "out of memory");
+        data->failed = true;
+    }
+    if (data->failed)
+        goto generate_done;
+
+    if (!stream)
+        generate_marker(out, source, data, 0, false);
+
+    generate_code(out, source, data->flushed, source->length - data->flushed, data, 0, false);
+
+    /* there are cases where we get no newline at the end of the file */
+    output_text(out, "\n", 1);
+    success = true;
+
+generate_done:
+    if (!output_flush(out) && success) {
+        parse_error(source, source->length, "failed to write output: %s", strerror(out->error));
+        success = false;
+    }
+    return success;
+}
+
+/* Cache */
+static inline uint64_t cache_rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t cache_fmix(uint64_t k) {
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+/* MurmurHash3 x64 128 */
+static void cache_hash(const void *key, size_t length, uint32_t seed, uint64_t out[2]) {
+    const unsigned char *data = (const unsigned char *)key;
+    const size_t   blocks = length / 16;
+    const uint64_t c1 = 0x87c37b91114253d5ULL;
+    const uint64_t c2 = 0x4cf5ad432745937fULL;
+    uint64_t       h1 = seed;
+    uint64_t       h2 = seed;
+
+    for (size_t i = 0; i != blocks; ++i) {
+        uint64_t k1, k2;
+        memcpy(&k1, data + i * 16, 8);
+        memcpy(&k2, data + i * 16 + 8, 8);
+        k1 *= c1; k1 = cache_rotl(k1, 31); k1 *= c2; h1 ^= k1;
+        h1 = cache_rotl(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+        k2 *= c2; k2 = cache_rotl(k2, 33); k2 *= c1; h2 ^= k2;
+        h2 = cache_rotl(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+    }
+
+    const unsigned char *tail = data + blocks * 16;
+    uint64_t             k1 = 0;
+    uint64_t             k2 = 0;
+    switch (length & 15) {
+        case 15: k2 ^= (uint64_t)tail[14] << 48; /* fallthrough */
+        case 14: k2 ^= (uint64_t)tail[13] << 40; /* fallthrough */
+        case 13: k2 ^= (uint64_t)tail[12] << 32; /* fallthrough */
+        case 12: k2 ^= (uint64_t)tail[11] << 24; /* fallthrough */
+        case 11: k2 ^= (uint64_t)tail[10] << 16; /* fallthrough */
+        case 10: k2 ^= (uint64_t)tail[ 9] << 8;  /* fallthrough */
+        case  9: k2 ^= (uint64_t)tail[ 8];
+                 k2 *= c2; k2 = cache_rotl(k2, 33); k2 *= c1; h2 ^= k2;
+                 /* fallthrough */
+        case  8: k1 ^= (uint64_t)tail[ 7] << 56; /* fallthrough */
+        case  7: k1 ^= (uint64_t)tail[ 6] << 48; /* fallthrough */
+        case  6: k1 ^= (uint64_t)tail[ 5] << 40; /* fallthrough */
+        case  5: k1 ^= (uint64_t)tail[ 4] << 32; /* fallthrough */
+        case  4: k1 ^= (uint64_t)tail[ 3] << 24; /* fallthrough */
+        case  3: k1 ^= (uint64_t)tail[ 2] << 16; /* fallthrough */
+        case  2: k1 ^= (uint64_t)tail[ 1] << 8;  /* fallthrough */
+        case  1: k1 ^= (uint64_t)tail[ 0];
+                 k1 *= c1; k1 = cache_rotl(k1, 31); k1 *= c2; h1 ^= k1;
+    }
+
+    h1 ^= length; h2 ^= length;
+    h1 += h2; h2 += h1;
+    h1 = cache_fmix(h1); h2 = cache_fmix(h2);
+    h1 += h2; h2 += h1;
+    out[0] = h1;
+    out[1] = h2;
+}
+
+/* The options are hashed on their own and seed the hash of the input */
+void lambda_cache_key(const lambda_source_t *source, char key[LAMBDA_CACHE_KEY]) {
+    char     options[4096];
+    size_t   length = 0;
+    uint64_t header[2], input[2];
+
+    length += snprintf(options, sizeof(options), "lambdapp " LAMBDAPP_VERSION "%c%d%d%d%d%d%d", 0,
+        source->short_enabled, source->stable_names, source->dedupe, source->inline_all, (int)source->markers, source->cxx);
+    for (size_t k = 0; k != source->keywords.count && length < sizeof(options); ++k)
+        length += snprintf(options + length, sizeof(options) - length, "%c%s", 0, source->keywords.words[k].word);
+    if (length < sizeof(options))
+        length += snprintf(options + length, sizeof(options) - length, "%c%s%c%s", 0, source->file, 0,
+            source->prefix ? source->prefix : "");
+    if (length > sizeof(options))
+        length = sizeof(options);
+
+    cache_hash(options, length, 0, header);
+    cache_hash(source->data, source->length, (uint32_t)(header[0] ^ header[1]), input);
+    snprintf(key, LAMBDA_CACHE_KEY, "%016llx%016llx",
+        (unsigned long long)(input[0] ^ header[1]), (unsigned long long)(input[1] ^ header[0]));
+}
+
+/* Entries are spread over directories named after the first two digits */
+static bool cache_path(const char *dir, const char *key, char *path, size_t size) {
+    return snprintf(path, size, "%s/%.2s/%s", dir, key, key + 2) < (int)size;
+}
+
+int lambda_cache_open(const lambda_source_t *source) {
+    char key[LAMBDA_CACHE_KEY];
+    char path[4096];
+    lambda_cache_key(source, key);
+    if (!cache_path(source->cache, key, path, sizeof(path)))
+        return -1;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0)
+        lambda_cache_count(source->cache, true);
+    return fd;
+}
+
+/* Written to a temporary file which is renamed into place so that readers
+ * never see a partial entry.
+ */
+static void cache_store(const lambda_source_t *source, const char *data, size_t size) {
+    char key[LAMBDA_CACHE_KEY];
+    char path[4096];
+    char temporary[4096];
+    lambda_cache_key(source, key);
+    if (!cache_path(source->cache, key, path, sizeof(path)))
+        return;
+    if (snprintf(temporary, sizeof(temporary), "%s/%.2s/.tmp.XXXXXX", source->cache, key) >= (int)sizeof(temporary))
+        return;
+
+    mkdir(source->cache, 0777);
+    *strrchr(path, '/') = '\0';
+    mkdir(path, 0777);
+    path[strlen(path)] = '/';
+
+    int fd = mkstemp(temporary);
+    if (fd < 0)
+        return;
+    bool success = true;
+    for (size_t wrote = 0; success && wrote != size; ) {
+        ssize_t r = write(fd, data + wrote, size - wrote);
+        if (r < 0 && errno == EINTR)
+            continue;
+        success = r > 0;
+        wrote  += success ? (size_t)r : 0;
+    }
+    fchmod(fd, 0644);
+    if (close(fd) || !success || rename(temporary, path))
+        unlink(temporary);
+}
+
+/* The counters are updated under an exclusive lock */
+void lambda_cache_count(const char *dir, bool hit) {
+    char path[4096];
+    if (snprintf(path, sizeof(path), "%s/stats", dir) >= (int)sizeof(path))
+        return;
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0 && errno == ENOENT && !mkdir(dir, 0777))
+        fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+        return;
+    if (!flock(fd, LOCK_EX)) {
+        char               buffer[64];
+        unsigned long long hits = 0, misses = 0;
+        ssize_t            r = pread(fd, buffer, sizeof(buffer) - 1, 0);
+        buffer[r > 0 ? r : 0] = '\0';
+        sscanf(buffer, "%llu %llu", &hits, &misses);
+        *(hit ? &hits : &misses) += 1;
+        int length = snprintf(buffer, sizeof(buffer), "%llu %llu\n", hits, misses);
+        if (pwrite(fd, buffer, length, 0) == length)
+            ftruncate(fd, length);
+    }
+    close(fd);
+}
+
+bool lambda_cache_stats(const char *dir, unsigned long long *hits, unsigned long long *misses) {
+    char path[4096];
+    char buffer[64];
+    *hits = *misses = 0;
+    if (snprintf(path, sizeof(path), "%s/stats", dir) >= (int)sizeof(path))
+        return false;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return errno == ENOENT;
+    flock(fd, LOCK_SH);
+    ssize_t r = read(fd, buffer, sizeof(buffer) - 1);
+    close(fd);
+    buffer[r > 0 ? r : 0] = '\0';
+    sscanf(buffer, "%llu %llu", hits, misses);
+    return r >= 0;
+}
+
+/* A hit is written out like any other slice of output */
+static bool generate_cached(lambda_output_t *out, lambda_source_t *source) {
+    struct stat st;
+    int         fd = lambda_cache_open(source);
+    if (fd < 0)
+        return false;
+    bool success = !fstat(fd, &st);
+    if (success && st.st_size) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if ((success = map != MAP_FAILED)) {
+            output_slice(out, (const char *)map, st.st_size);
+            if (!output_flush(out))
+                parse_error(source, source->length, "failed to write output: %s", strerror(out->error));
+            munmap(map, st.st_size);
+        }
+    }
+    close(fd);
+    return success;
+}
+
+/* Without any of the keywords there can't be a lambda, the input only gets
+ * its marker.
+ */
+bool lambda_source_plain(const lambda_source_t *source) {
+    for (size_t k = 0; k != source->keywords.count; ++k) {
+        const lambda_keyword_t *keyword = &source->keywords.words[k];
+        const char             *find    = source->data;
+        const char             *last;
+        if (source->length < keyword->length)
+            continue;
+        last = source->data + source->length - keyword->length;
+        while (find <= last && (find = (const char *)memchr(find, keyword->word[0], last - find + 1))) {
+            if (!memcmp(find, keyword->word, keyword->length))
+                return false;
+            find++;
+        }
+    }
+    return true;
+}
+
+static bool generate_plain(lambda_output_t *out, lambda_source_t *source) {
+    generate_marker(out, source, NULL, 0, false);
+    output_slice(out, source->data, source->length);
+    output_text(out, "\n", 1);
+    if (!output_flush(out)) {
+        parse_error(source, source->length, "failed to write output: %s", strerror(out->error));
+        return false;
+    }
+    return true;
+}
+
+static bool generate_source(lambda_output_t *out, lambda_source_t *source, lambda_arena_t *arena, bool stream) {
+    parse_data_t data;
+    bool         success = false;
+
+    if (lambda_source_plain(source)) {
+        if (source->stats)
+            source->stats->plain = true;
+        return generate_plain(out, source);
+    }
+
+    /* a failed write has no translation to fall back to */
+    if (source->cache && generate_cached(out, source)) {
+        if (source->stats)
+            source->stats->cached = true;
+        return !out->error;
+    }
+
+    /* the output is captured to go into the cache, unless someone else
+     * captures it already
+     */
+    bool capturing = out->capturing;
+    if (source->cache) {
+        lambda_cache_count(source->cache, false);
+        out->capturing = true;
+    }
+
+    if (parse_data_init(&data, arena))
+        success = generate_data(out, source, &data, stream);
+    else {
+        parse_error(source, source->length, "out of memory");
+        output_flush(out);
+    }
+    lambda_arena_reset(arena);
+
+    if (source->cache) {
+        if (success && out->capturing)
+            cache_store(source, out->capture, out->captured);
+        if (!capturing) {
+            out->capturing = false;
+            out->captured  = 0;
+        }
+    }
+    return success;
+}
+
+static bool generate_timed(lambda_output_t *out, lambda_source_t *source, lambda_arena_t *arena, bool stream) {
+    lambda_stats_t *stats = source->stats;
+    if (!stats)
+        return generate_source(out, source, arena, stream);
+
+    size_t written = out->written;
+    size_t markers = out->markers;
+    stats->generate.begin    = lambda_clock();
+    bool success             = generate_source(out, source, arena, stream);
+    stats->generate.duration = lambda_clock() - stats->generate.begin;
+    stats->bytes_in          = source->length;
+    stats->bytes_out         = out->written - written;
+    stats->markers           = out->markers - markers;
+    stats->arena_peak        = arena->peak;
+    stats->arena_reserved    = arena->reserved;
+    return success;
+}
+
+bool generate(lambda_output_t *out, lambda_source_t *source, lambda_arena_t *arena, bool stream) {
+    /* a prefix derived from the file name lives as long as the translation */
+    char *prefix = NULL;
+    if (source->prefix_file && !source->prefix && !(source->prefix = prefix = lambda_prefix(source->file))) {
+        parse_error(source, 0, "out of memory");
+        return false;
+    }
+    bool success = generate_timed(out, source, arena, stream);
+    if (prefix) {
+        source->prefix = NULL;
+        free(prefix);
+    }
+    return success;
+}
+
+/* Statistics */
+uint64_t lambda_clock(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+}
+
+static inline double stats_ms(uint64_t ns) {
+    return ns / 1e6;
+}
+
+void lambda_stats_print(int fd, const char *file, const lambda_stats_t *stats) {
+    dprintf(fd, "%s: %zu bytes in, %zu out, %zu lambdas nested %zu deep, %zu positions, %zu markers%s\n",
+        file, stats->bytes_in, stats->bytes_out, stats->lambdas, stats->depth, stats->positions, stats->markers,
+        stats->cached ? ", from the cache" : stats->plain ? ", passed through" : "");
+    dprintf(fd, "%s: open %.3fms, parse %.3fms, generate %.3fms, arena peak %zu bytes, %zu reserved\n",
+        file, stats_ms(stats->open.duration), stats_ms(stats->parse.duration),
+        stats_ms(stats->generate.duration - stats->parse.duration), stats->arena_peak, stats->arena_reserved);
+}
+
+size_t lambda_json_string(char *buffer, size_t size, const char *text) {
+    size_t length = 0;
+    #define json_put(ch) do { if (length < size) buffer[length] = (ch); length++; } while (0)
+    json_put('"');
+    for (const unsigned char *c = (const unsigned char *)text; *c; ++c) {
+        if (*c == '"' || *c == '\\') {
+            json_put('\\');
+            json_put(*c);
+        } else if (*c < 0x20) {
+            char escape[8];
+            snprintf(escape, sizeof(escape), "\\u%04x", *c);
+            for (const char *e = escape; *e; ++e)
+                json_put(*e);
+        } else
+            json_put(*c);
+    }
+    json_put('"');
+    #undef json_put
+    if (size)
+        buffer[length < size ? length : size - 1] = '\0';
+    return length;
+}
+
+bool lambda_stats_json(int fd, const char *file, const lambda_stats_t *stats) {
+    char   line[8192];
+    size_t length = lambda_json_string(line + 9, sizeof(line) - 9, file) + 9;
+    memcpy(line, "{\"file\": ", 9);
+    if (length >= sizeof(line))
+        return false;
+    length += snprintf(line + length, sizeof(line) - length,
+        ", \"open_ns\": %llu, \"parse_ns\": %llu, \"generate_ns\": %llu"
+        ", \"bytes_in\": %zu, \"bytes_out\": %zu, \"lambdas\": %zu, \"depth\": %zu"
+        ", \"positions\": %zu, \"markers\": %zu, \"arena_peak\": %zu, \"arena_reserved\": %zu"
+        ", \"cached\": %s, \"plain\": %s}\n",
+        (unsigned long long)stats->open.duration, (unsigned long long)stats->parse.duration,
+        (unsigned long long)(stats->generate.duration - stats->parse.duration),
+        stats->bytes_in, stats->bytes_out, stats->lambdas, stats->depth,
+        stats->positions, stats->markers, stats->arena_peak, stats->arena_reserved,
+        stats->cached ? "true" : "false", stats->plain ? "true" : "false");
+    return length < sizeof(line) && write(fd, line, length) == (ssize_t)length;
+}
+
+/* Trace */
+void lambda_trace_init(lambda_trace_t *trace) {
+    memset(trace, 0, sizeof(*trace));
+    pthread_mutex_init(&trace->mutex, NULL);
+}
+
+void lambda_trace_destroy(lambda_trace_t *trace) {
+    pthread_mutex_destroy(&trace->mutex);
+    free(trace->events);
+}
+
+/* An event which doesn't fit into memory is left out of the trace */
+void lambda_trace_event(lambda_trace_t *trace, const char *name, const char *file, const lambda_span_t *span, unsigned tid) {
+    char   event[8192];
+    size_t length = snprintf(event, sizeof(event),
+        "%s{\"name\": \"%s\", \"cat\": \"lambdapp\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f"
+        ", \"pid\": %ld, \"tid\": %u, \"args\": {\"file\": ",
+        ",\n", name, span->begin / 1e3, span->duration / 1e3, (long)getpid(), tid);
+    length += lambda_json_string(event + length, sizeof(event) - length, file ? file : "");
+    if (length + 3 > sizeof(event))
+        return;
+    memcpy(event + length, "}}", 3);
+    length += 2;
+
+    pthread_mutex_lock(&trace->mutex);
+    if (trace->used + length > trace->size) {
+        size_t request = trace->size ? trace->size * 2 : 1 << 16;
+        while (request < trace->used + length)
+            request *= 2;
+        char *temp = (char *)realloc(trace->events, request);
+        if (temp) {
+            trace->events = temp;
+            trace->size   = request;
+        }
+    }
+    if (trace->used + length <= trace->size) {
+        /* the first event goes without the separator */
+        size_t skip = trace->used ? 0 : 2;
+        memcpy(trace->events + trace->used, event + skip, length - skip);
+        trace->used += length - skip;
+    }
+    pthread_mutex_unlock(&trace->mutex);
+}
+
+bool lambda_trace_write(lambda_trace_t *trace, const char *path) {
+    FILE *file = fopen(path, "w");
+    if (!file)
+        return false;
+    fprintf(file, "{\"traceEvents\": [\n");
+    fwrite(trace->events, 1, trace->used, file);
+    fprintf(file, "\n], \"displayTimeUnit\": \"ms\"}\n");
+    return !fclose(file);
+}
+
+/* Library */
+void lambdapp_options_init(lambdapp_options *options) {
+    memset(options, 0, sizeof(*options));
+    options->short_syntax = true;
+}
+
+bool lambdapp_translate(const char *buffer, size_t length, const lambdapp_options *options,
+                        lambdapp_sink sink, void *user, lambdapp_result *result)
+{
+    lambda_source_t  source;
+    lambda_arena_t   arena;
+    parse_data_t     data;
+    lambda_output_t *out;
+    bool             success = false;
+
+    lambda_source_init(&source);
+    source.error = -1;
+    if (result) {
+        memset(result, 0, sizeof(*result));
+        source.message      = result->error;
+        source.message_size = sizeof(result->error);
+    }
+    source.file          = options && options->file ? options->file : "<buffer>";
+    source.short_enabled = options ? options->short_syntax : true;
+    source.stable_names  = options && options->stable_names;
+    source.dedupe        = options && options->dedupe;
+    source.inline_all    = options && options->inline_all;
+    source.markers       = options ? (lambda_markers_t)options->markers : LAMBDA_MARKERS_ALL;
+    source.prefix        = options ? options->prefix : NULL;
+    source.cxx           = options && options->cxx;
+    source.cache         = options && !result ? options->cache_dir : NULL;
+    source.data          = buffer;
+    source.length        = length;
+    if (options && options->markers != LAMBDAPP_MARKERS_ALL && options->markers != LAMBDAPP_MARKERS_CHANGED
+        && options->markers != LAMBDAPP_MARKERS_NONE)
+    {
+        parse_error(&source, 0, "invalid marker mode: %d", options->markers);
+        return false;
+    }
+    if (source.prefix && (!lambda_prefix_valid(source.prefix) || strlen(source.prefix) > LAMBDAPP_PREFIX_MAX)) {
+        parse_error(&source, 0, "invalid prefix: %s", source.prefix);
+        return false;
+    }
+    for (const char *const *keyword = options ? options->keywords : NULL; keyword && *keyword; ++keyword) {
+        if (!lambda_keywords_add(&source.keywords, *keyword)) {
+            parse_error(&source, 0, "invalid or too many keywords: %s", *keyword);
+            return false;
+        }
+    }
+    lambda_source_prepare(&source);
+
+    if (!(out = output_create())) {
+        parse_error(&source, length, "out of memory");
+        return false;
+    }
+    output_init(out, -1);
+    out->sink = sink;
+    out->user = user;
+
+    lambda_arena_init(&arena);
+    /* the cache only holds the output, the lambdas always come from a parse */
+    if (!result)
+        success = generate_source(out, &source, &arena, false);
+    else if (lambda_source_plain(&source))
+        success = generate_plain(out, &source);
+    else if (!parse_data_init(&data, &arena))
+        parse_error(&source, length, "out of memory");
+    else if ((success = generate_data(out, &source, &data, false)) && result && data.lambdas.elements) {
+        result->lambdas = (lambdapp_lambda *)malloc(sizeof(*result->lambdas) * data.lambdas.elements);
+        if (!result->lambdas) {
+            parse_error(&source, length, "out of memory");
+            success = false;
+        }
+        for (size_t i = 0; success && i != data.lambdas.elements; ++i) {
+            const lambda_t  *lambda = &data.lambdas.funcs[i];
+            lambdapp_lambda *copy   = &result->lambdas[i];
+            copy->index           = i;
+            copy->start           = data.starts.offsets[i];
+            copy->captures.begin  = lambda->captures.begin;
+            copy->captures.length = lambda->captures.length;
+            copy->decl.begin      = lambda->decl.begin;
+            copy->decl.length     = lambda->decl.length;
+            copy->body.begin      = lambda->body.begin;
+            copy->body.length     = lambda->body.length;
+            copy->name_offset     = lambda->name_offset;
+            copy->decl_line       = lambda_line(&data, &source, lambda->decl.begin);
+            copy->body_line       = lambda_line(&data, &source, lambda->decl.begin + lambda->decl.length);
+            copy->end_line        = lambda_line(&data, &source, lambda->body.begin + lambda->body.length);
+            copy->is_short        = lambda->is_short;
+            if (lambda_native(&source, lambda)) {
+                copy->name[0] = '\0';
+                continue;
+            }
+            const char *prefix    = source.prefix ? source.prefix : "";
+            const char *separator = source.prefix ? "_" : "";
+            if (!source.stable_names)
+                snprintf(copy->name, sizeof(copy->name), "lambda_%s%s%zu", prefix, separator, lambda->duplicate ? lambda->number : i);
+            else if (lambda->same)
+                snprintf(copy->name, sizeof(copy->name), "lambda_%s%s%016llx_%zu", prefix, separator, (unsigned long long)lambda->hash, (size_t)lambda->same);
+            else
+                snprintf(copy->name, sizeof(copy->name), "lambda_%s%s%016llx", prefix, separator, (unsigned long long)lambda->hash);
+        }
+        if (success)
+            result->count = data.lambdas.elements;
+    }
+    lambda_arena_destroy(&arena);
+    output_destroy(out);
+    return success;
+}
+
+void lambdapp_result_destroy(lambdapp_result *result) {
+    free(result->lambdas);
+    result->lambdas = NULL;
+    result->count   = 0;
+}
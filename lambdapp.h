@@ -0,0 +1,101 @@
+/*
+* Copyright (C) 2014
+*   Wolfgang Bumiller
+*   Dale Weiler
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy of
+* this software and associated documentation files (the "Software"), to deal in
+* the Software without restriction, including without limitation the rights to
+* use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+* of the Software, and to permit persons to whom the Software is furnished to do
+* so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+#ifndef LAMBDAPP_HDR
+#define LAMBDAPP_HDR
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Translating buffers in memory with liblambdapp. Nothing is shared between
+ * calls so any number of them can run at the same time on different threads.
+ */
+typedef struct {
+    const char        *file;          /* the name in #line markers, "<buffer>" when NULL */
+    const char *const *keywords;      /* terminated by NULL, the default keyword when NULL */
+    bool               short_syntax;  /* allow => single statement bodies */
+    bool               stable_names;  /* name lambdas after a hash of their text instead of their index */
+    bool               dedupe;        /* lambdas with the same text share one function */
+    bool               inline_all;    /* declare all of the functions inline */
+    int                markers;       /* LAMBDAPP_MARKERS_ALL, _CHANGED or _NONE, anything else is an error */
+    const char        *prefix;        /* names become lambda_<prefix>_N, up to LAMBDAPP_PREFIX_MAX characters */
+    bool               cxx;           /* C++ lambdas in place where possible, which have no name */
+    const char        *cache_dir;     /* translation cache shared with lambda-pp, only used without a result */
+} lambdapp_options;
+
+/* #line markers at every function and after every insertion, only where
+ * the line the compiler counts is off, or none at all
+ */
+#define LAMBDAPP_MARKERS_ALL     0
+#define LAMBDAPP_MARKERS_CHANGED 1
+#define LAMBDAPP_MARKERS_NONE    2
+
+#define LAMBDAPP_PREFIX_MAX 64
+
+typedef struct {
+    size_t begin;  /* offset into the buffer */
+    size_t length;
+} lambdapp_range;
+
+/* A lambda in the buffer, it becomes the function called name */
+typedef struct {
+    size_t         index;
+    size_t         start;       /* offset of the keyword */
+    lambdapp_range captures;    /* inside the brackets, empty without captures */
+    lambdapp_range decl;        /* the return type and parameters */
+    lambdapp_range body;        /* including the braces, or the statement after => */
+    size_t         name_offset; /* where the name goes into the declaration */
+    size_t         decl_line;
+    size_t         body_line;
+    size_t         end_line;
+    bool           is_short;
+    char           name[48 + LAMBDAPP_PREFIX_MAX]; /* shared by identical lambdas with dedupe, empty for a C++ lambda */
+} lambdapp_lambda;
+
+typedef struct {
+    lambdapp_lambda *lambdas;
+    size_t           count;
+    char             error[256]; /* the first error, empty on success */
+} lambdapp_result;
+
+/* Receives the output in pieces, returning false stops the translation */
+typedef bool (*lambdapp_sink)(void *user, const char *data, size_t length);
+
+void lambdapp_options_init(lambdapp_options *options);
+
+/* Translates length bytes of buffer and passes the output to sink. When result
+ * isn't NULL it receives the lambdas found and the error message, it has to be
+ * released with lambdapp_result_destroy() either way.
+ */
+bool lambdapp_translate(const char *buffer, size_t length, const lambdapp_options *options,
+                        lambdapp_sink sink, void *user, lambdapp_result *result);
+
+void lambdapp_result_destroy(lambdapp_result *result);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,201 @@
+/* Translates a file through liblambdapp on several threads at once, checks
+ * they agree and that the lambda table points at the lambdas, then writes the
+ * output to stdout. Invalid options have to be refused. With --cache-dir the
+ * file is translated twice more through an empty cache, which has to miss
+ * once and then hit once with the same output.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "lambdapp.h"
+#include "lambdapp-internal.h"
+
+#define THREADS 4
+
+typedef struct {
+    char   *data;
+    size_t  length;
+    size_t  allocated;
+} buffer_t;
+
+typedef struct {
+    const char       *input;
+    size_t            length;
+    lambdapp_options *options;
+    buffer_t          output;
+    lambdapp_result   result;
+    bool              success;
+} job_t;
+
+static bool sink(void *user, const char *data, size_t length) {
+    buffer_t *buffer = user;
+    if (buffer->length + length > buffer->allocated) {
+        size_t request = buffer->allocated ? buffer->allocated : 4096;
+        while (request < buffer->length + length)
+            request *= 2;
+        char *temp = realloc(buffer->data, request);
+        if (!temp)
+            return false;
+        buffer->data = temp;
+        buffer->allocated = request;
+    }
+    memcpy(buffer->data + buffer->length, data, length);
+    buffer->length += length;
+    return true;
+}
+
+static void *run(void *argument) {
+    job_t *job = argument;
+    job->success = lambdapp_translate(job->input, job->length, job->options, &sink, &job->output, &job->result);
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    const char      *keywords[16] = { NULL };
+    size_t           count = 0;
+    const char      *cache = NULL;
+    lambdapp_options options;
+    lambdapp_options_init(&options);
+
+    int i = 1;
+    for (; i < argc - 1; i++) {
+        if (!strcmp(argv[i], "--stable-names"))
+            options.stable_names = true;
+        else if (!strcmp(argv[i], "--dedupe"))
+            options.dedupe = true;
+        else if (!strcmp(argv[i], "--inline"))
+            options.inline_all = true;
+        else if (!strcmp(argv[i], "--cxx"))
+            options.cxx = true;
+        else if (!strcmp(argv[i], "--markers=changed"))
+            options.markers = LAMBDAPP_MARKERS_CHANGED;
+        else if (!strcmp(argv[i], "--markers=none"))
+            options.markers = LAMBDAPP_MARKERS_NONE;
+        else if (!strncmp(argv[i], "--prefix=", 9))
+            options.prefix = argv[i] + 9;
+        else if (!strcmp(argv[i], "--stream"))
+            ; /* the output has to be the same as without */
+        else if (!strcmp(argv[i], "--cache-dir") && i < argc - 2)
+            cache = argv[++i];
+        else if (!strcmp(argv[i], "-k") && i < argc - 2 && count < 15)
+            keywords[count++] = argv[++i];
+        else
+            break;
+    }
+    if (i != argc - 1) {
+        fprintf(stderr, "usage: %s [--stable-names] [--dedupe] [--inline] [--cxx] [--markers=MODE] [--prefix=NAME] [--stream] [--cache-dir DIR] [-k keyword]... file\n", argv[0]);
+        return 1;
+    }
+    options.file     = argv[i];
+    options.keywords = count ? keywords : NULL;
+
+    FILE *file = fopen(argv[i], "rb");
+    if (!file) {
+        perror(argv[i]);
+        return 1;
+    }
+    buffer_t input = { NULL, 0, 0 };
+    char     chunk[4096];
+    size_t   got;
+    while ((got = fread(chunk, 1, sizeof(chunk), file)))
+        sink(&input, chunk, got);
+    fclose(file);
+
+    job_t     jobs[THREADS];
+    pthread_t threads[THREADS];
+    memset(jobs, 0, sizeof(jobs));
+    for (int j = 0; j != THREADS; j++) {
+        jobs[j].input   = input.data;
+        jobs[j].length  = input.length;
+        jobs[j].options = &options;
+        pthread_create(&threads[j], NULL, &run, &jobs[j]);
+    }
+    for (int j = 0; j != THREADS; j++)
+        pthread_join(threads[j], NULL);
+
+    int status = 0;
+    /* a marker mode the library doesn't know is refused */
+    lambdapp_options bad     = options;
+    lambdapp_result  refused;
+    buffer_t         discard = { NULL, 0, 0 };
+    bad.markers = LAMBDAPP_MARKERS_NONE + 1;
+    if (lambdapp_translate(input.data, input.length, &bad, &sink, &discard, &refused) || !*refused.error) {
+        fprintf(stderr, "%s: an invalid marker mode was accepted\n", argv[i]);
+        status = 1;
+    }
+    lambdapp_result_destroy(&refused);
+    free(discard.data);
+
+    /* the cache is only used without a result */
+    lambdapp_options cached = options;
+    cached.cache_dir = cache;
+    for (int run = 0; cache && run != 2; run++) {
+        buffer_t           got = { NULL, 0, 0 };
+        unsigned long long hits = 0, misses = 0;
+        bool               success = lambdapp_translate(input.data, input.length, &cached, &sink, &got, NULL);
+        if (!success || !lambda_cache_stats(cache, &hits, &misses) || hits != (unsigned)run || misses != 1) {
+            fprintf(stderr, "%s: expected %d hits and 1 miss in %s, got %llu and %llu\n", argv[i], run, cache, hits, misses);
+            status = 1;
+        } else if (got.length != jobs[0].output.length || memcmp(got.data, jobs[0].output.data, got.length)) {
+            fprintf(stderr, "%s: the translation differs on a cache %s\n", argv[i], run ? "hit" : "miss");
+            status = 1;
+        }
+        free(got.data);
+    }
+
+    for (int j = 0; j != THREADS; j++) {
+        if (jobs[j].success != jobs[0].success || jobs[j].output.length != jobs[0].output.length
+            || memcmp(jobs[j].output.data, jobs[0].output.data, jobs[0].output.length)
+            || jobs[j].result.count != jobs[0].result.count)
+        {
+            fprintf(stderr, "%s: thread %d produced a different translation\n", argv[i], j);
+            status = 1;
+        }
+    }
+    if (!jobs[0].success) {
+        fprintf(stderr, "%s\n", jobs[0].result.error);
+        status = 1;
+    }
+
+    for (size_t l = 0; l != jobs[0].result.count; l++) {
+        const lambdapp_lambda *lambda = &jobs[0].result.lambdas[l];
+        const char            *body   = input.data + lambda->body.begin;
+        char                   name[48 + LAMBDAPP_PREFIX_MAX];
+        char                   prefix[LAMBDAPP_PREFIX_MAX + 9];
+        snprintf(prefix, sizeof(prefix), "lambda_%s%s", options.prefix ? options.prefix : "", options.prefix ? "_" : "");
+        snprintf(name, sizeof(name), "%s%zu", prefix, l);
+        if (options.stable_names && strlen(lambda->name) >= strlen(prefix) + 16)
+            memcpy(name, lambda->name, sizeof(name));
+        else if (options.dedupe && !options.stable_names) {
+            /* the function of an identical lambda */
+            size_t same = l;
+            if (!strncmp(lambda->name, prefix, strlen(prefix)))
+                sscanf(lambda->name + strlen(prefix), "%zu", &same);
+            const lambdapp_lambda *other = same < jobs[0].result.count ? &jobs[0].result.lambdas[same] : lambda;
+            size_t length = lambda->body.begin + lambda->body.length - lambda->decl.begin;
+            if (other->body.begin + other->body.length - other->decl.begin == length
+                && !memcmp(input.data + other->decl.begin, input.data + lambda->decl.begin, length))
+                snprintf(name, sizeof(name), "%s%zu", prefix, same);
+        }
+        if (options.cxx && !*lambda->name)
+            *name = 0; /* written as a C++ lambda */
+        if (lambda->index != l || strcmp(lambda->name, name) || lambda->decl.begin <= lambda->start
+            || lambda->body.begin + lambda->body.length > input.length
+            || lambda->decl_line > lambda->body_line || lambda->body_line > lambda->end_line
+            || (lambda->is_short ? strncmp(body - 2, "=>", 2) : *body != '{'))
+        {
+            fprintf(stderr, "%s: bad table entry for %s\n", argv[i], name);
+            status = 1;
+        }
+    }
+
+    fwrite(jobs[0].output.data, 1, jobs[0].output.length, stdout);
+    for (int j = 0; j != THREADS; j++) {
+        lambdapp_result_destroy(&jobs[j].result);
+        free(jobs[j].output.data);
+    }
+    free(input.data);
+    return status;
+}
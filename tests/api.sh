@@ -0,0 +1,54 @@
+#!/usr/bin/env bash
+# Translates the tests through liblambdapp and checks the output matches the
+# one of lambda-pp, and once more through a translation cache.
+
+LAMBDAPP="../lambda-pp"
+API="./api"
+
+err() {
+  local mesg="$1"; shift
+  printf "*** ${mesg}\n" "$@" >&2
+}
+
+msg() {
+  local mesg="$1"; shift
+  printf "==> ${mesg}\n" "$@" >&2
+}
+
+die() {
+  err "$@"
+  exit 1
+}
+
+[[ -x ${LAMBDAPP} ]] || die 'failed to find lambdapp at: %s' "$LAMBDAPP"
+[[ -x ${API} ]] || die 'failed to find the api test at: %s' "$API"
+
+# the first line of a test may hold the flags it needs
+test_flags() {
+  sed -n '1s/^\/\* FLAGS: \(.*\) \*\/$/\1/p' "$1"
+}
+
+output=$(mktemp)
+cache=$(mktemp -d)
+trap 'rm -rf "$output" "$cache"' EXIT
+
+failed=0
+for test in *.l.c; do
+  flags=$(test_flags "$test")
+  if ! ${API} $flags "$test" > "$output"; then
+    err '%s: failed to translate' "$test"
+    failed=1
+  elif ! ${LAMBDAPP} $flags "$test" | cmp -s - "$output"; then
+    err '%s: output differs from lambda-pp' "$test"
+    failed=1
+  fi
+done
+
+# lambdapp_translate through a cache, which starts out empty
+if ! ${API} --cache-dir "$cache" basic.l.c > "$output"; then
+  err 'basic.l.c: failed to translate through the cache'
+  failed=1
+fi
+
+(( failed )) || msg 'All api tests succeeded'
+exit $failed
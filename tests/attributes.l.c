@@ -0,0 +1,25 @@
+/* FLAGS: --inline */
+#include <stdio.h>
+
+static inline void foreach(const int *values, int count, void (*func)(int)) {
+  for (int i = 0; i != count; i++)
+    func(values[i]);
+}
+
+int main(int argc, char **argv) {
+  int values[] = { 1, 2, 3 };
+  foreach(values, 3, lambda [[hot, inline]] void(int v) {
+    printf("%i\n", v);
+  });
+  foreach(values, 1, lambda [[cold]] [[flatten]] void(int v) => printf("cold %i\n", v););
+  foreach(values + 2, 1, lambda void(int v) => printf("plain %i\n", v););
+  return 0;
+}
+
+/* OUTPUT:
+1
+2
+3
+cold 1
+plain 3
+*/
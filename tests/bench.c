@@ -0,0 +1,89 @@
+/* Runs a command a number of times with its output discarded and prints the
+ * results as a JSON object: the best and the median wall time, the throughput
+ * and time per lambda of the best run, and the peak RSS over all of them.
+ */
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define RUNS_MAX 64
+
+static int compare(const void *a, const void *b) {
+    long long x = *(const long long *)a;
+    long long y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+/* Returns the wall time in nanoseconds, or -1 when the command failed */
+static long long run(char **command, long *rss) {
+    struct timespec start, end;
+    struct rusage   usage;
+    int             status;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pid_t pid = fork();
+    if (pid < 0)
+        return -1;
+    if (!pid) {
+        int null = open("/dev/null", O_WRONLY);
+        if (null >= 0)
+            dup2(null, STDOUT_FILENO);
+        execvp(command[0], command);
+        fprintf(stderr, "failed to run %s: %s\n", command[0], strerror(errno));
+        _exit(127);
+    }
+    if (wait4(pid, &status, 0, &usage) < 0)
+        return -1;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (!WIFEXITED(status) || WEXITSTATUS(status))
+        return -1;
+    if (usage.ru_maxrss > *rss)
+        *rss = usage.ru_maxrss;
+    return (end.tv_sec - start.tv_sec) * 1000000000LL + (end.tv_nsec - start.tv_nsec);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 6) {
+        fprintf(stderr, "usage: %s name bytes lambdas runs command...\n", argv[0]);
+        return 1;
+    }
+    const char        *name    = argv[1];
+    unsigned long long bytes   = strtoull(argv[2], NULL, 10);
+    unsigned long long lambdas = strtoull(argv[3], NULL, 10);
+    int                runs    = atoi(argv[4]);
+    long long          times[RUNS_MAX];
+    long               rss = 0;
+
+    if (runs < 1 || runs > RUNS_MAX) {
+        fprintf(stderr, "%s: runs has to be between 1 and %d\n", argv[0], RUNS_MAX);
+        return 1;
+    }
+    for (int i = 0; i != runs; i++) {
+        if ((times[i] = run(argv + 5, &rss)) < 0) {
+            fprintf(stderr, "%s: %s failed\n", argv[0], name);
+            return 1;
+        }
+    }
+    qsort(times, runs, sizeof(*times), &compare);
+
+    long long best = times[0] ? times[0] : 1;
+    printf("{\"name\": \"%s\", \"bytes\": %llu, \"lambdas\": %llu, \"runs\": %d, "
+           "\"best_ns\": %lld, \"median_ns\": %lld, \"mb_per_s\": %.2f, ",
+           name, bytes, lambdas, runs, times[0], times[runs / 2], bytes * 1e3 / best);
+    if (lambdas)
+        printf("\"ns_per_lambda\": %.2f, ", (double)best / lambdas);
+    else
+        printf("\"ns_per_lambda\": null, ");
+    printf("\"peak_rss_kb\": %ld}\n", rss);
+    return 0;
+}
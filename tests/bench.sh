@@ -0,0 +1,132 @@
+#!/usr/bin/env bash
+# Benchmarks lambda-pp on synthetic inputs and lambda-cc end to end, writing
+# the results to $BENCH_OUTPUT as JSON so that they can be compared between
+# commits.
+
+LAMBDAPP="../lambda-pp"
+LAMBDACC="../lambda-cc"
+RUNNER="./bench-run"
+RUNS="${RUNS:-5}"
+BENCH_OUTPUT="${BENCH_OUTPUT:-bench.json}"
+
+err() {
+  local mesg="$1"; shift
+  printf "*** ${mesg}\n" "$@" >&2
+}
+
+msg() {
+  local mesg="$1"; shift
+  printf "==> ${mesg}\n" "$@" >&2
+}
+
+die() {
+  err "$@"
+  exit 1
+}
+
+[[ -x ${LAMBDAPP} ]] || die 'failed to find lambdapp at: %s' "$LAMBDAPP"
+[[ -x ${LAMBDACC} ]] || die 'failed to find lambda-cc at: %s' "$LAMBDACC"
+[[ -x ${RUNNER}   ]] || die 'failed to find the benchmark runner at: %s' "$RUNNER"
+
+# The generators write the input to stdout and the number of lambdas in it
+# to the file given as their second argument.
+
+# n functions without any lambda
+gen_plain() {
+  awk -v n="$1" 'BEGIN {
+    for (i = 0; i < n; i++)
+      printf "static int plain_%d(int x) { return x * %d + 1; } /* no keyword */\n", i, i;
+  }'
+  echo 0 > "$2"
+}
+
+# n top-level lambdas
+gen_flat() {
+  awk -v n="$1" 'BEGIN {
+    for (i = 0; i < n; i++)
+      printf "int (*f%d)(int) = lambda int(int x) { return x + %d; };\n", i, i;
+  }'
+  echo "$1" > "$2"
+}
+
+# lambdas nested n levels deep
+gen_deep() {
+  awk -v n="$1" 'BEGIN {
+    printf "void (*f)(void) = ";
+    for (i = 0; i < n; i++) printf "lambda void(void) { g(";
+    printf "0";
+    for (i = 0; i < n; i++) printf "); }";
+    printf ";\n";
+  }'
+  echo "$1" > "$2"
+}
+
+# n blocks of a 4K string literal and a 4K comment, which mention the keyword
+# and have brackets in them, with a lambda after each
+gen_strings() {
+  awk -v n="$1" 'BEGIN {
+    text = "";
+    while (length(text) < 4096) text = text "lambda void(void) { ( [ ";
+    for (i = 0; i < n; i++) {
+      printf "static const char *s%d = \"%s\";\n", i, text;
+      printf "/* %s */\n", text;
+      printf "int (*f%d)(void) = lambda int(void) { return %d; };\n", i, i;
+    }
+  }'
+  echo "$1" > "$2"
+}
+
+# lambda-cc with all of the system headers it includes, followed by the
+# tests, repeated n times
+gen_amalgamation() {
+  local headers
+  headers=$(${CC:-cc} -E -std=c11 -D_DEFAULT_SOURCE ../lambda-cc.c) \
+    || die 'failed to preprocess lambda-cc.c'
+  for (( i = 0; i < $1; i++ )); do
+    printf '%s\n' "$headers"
+    cat *.l.c
+  done
+  # only a rough count, keywords in comments and strings are counted as well
+  echo $(( $(cat *.l.c | grep -ow lambda | wc -l) * $1 )) > "$2"
+}
+
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+results=()
+bench() {
+  local name="$1"; shift
+  local input="$1"; shift
+  local lambdas=$(cat "$work/lambdas")
+  local bytes=$(wc -c < "$input")
+  local result
+  result=$(${RUNNER} "$name" "$bytes" "$lambdas" "$RUNS" "$@") || die 'failed to run %s' "$name"
+  results+=("$result")
+  msg '%s' "$result"
+}
+
+for test in plain:131072 flat:100000 deep:10000 strings:1024 amalgamation:8; do
+  name=${test%:*}
+  size=${test#*:}
+  gen_$name $size "$work/lambdas" > "$work/$name.c"
+  bench "pp-$name" "$work/$name.c" ${LAMBDAPP} "$work/$name.c"
+done
+
+# compiling the same inputs through lambda-cc, where the compiler dominates
+for test in plain:4096 flat:2000; do
+  name=${test%:*}
+  size=${test#*:}
+  gen_$name $size "$work/lambdas" > "$work/$name.c"
+  bench "cc-$name" "$work/$name.c" ${LAMBDACC} -c "$work/$name.c" -o "$work/$name.o"
+done
+
+commit=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+{
+  printf '{"commit": "%s", "date": "%s", "results": [\n' "$commit" "$(date -u +%Y-%m-%dT%H:%M:%SZ)"
+  for (( i = 0; i < ${#results[@]}; i++ )); do
+    (( i )) && printf ',\n'
+    printf '  %s' "${results[i]}"
+  done
+  printf '\n]}\n'
+} > "$BENCH_OUTPUT" || die 'failed to write %s' "$BENCH_OUTPUT"
+msg 'Results written to %s' "$BENCH_OUTPUT"
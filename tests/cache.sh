@@ -0,0 +1,63 @@
+#!/usr/bin/env bash
+# Translates the tests with a translation cache and checks the output stays
+# the same when it comes from the cache.
+
+LAMBDAPP="../lambda-pp"
+
+err() {
+  local mesg="$1"; shift
+  printf "*** ${mesg}\n" "$@" >&2
+}
+
+msg() {
+  local mesg="$1"; shift
+  printf "==> ${mesg}\n" "$@" >&2
+}
+
+die() {
+  err "$@"
+  exit 1
+}
+
+[[ -x ${LAMBDAPP} ]] || die 'failed to find lambdapp at: %s' "$LAMBDAPP"
+
+# the first line of a test may hold the flags it needs
+test_flags() {
+  sed -n '1s/^\/\* FLAGS: \(.*\) \*\/$/\1/p' "$1"
+}
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+export LAMBDAPP_CACHE_DIR="$dir/cache"
+
+failed=0
+count=0
+for test in *.l.c; do
+  flags=$(test_flags "$test")
+  LAMBDAPP_CACHE_DIR= ${LAMBDAPP} $flags "$test" > "$dir/expected"
+  for run in miss hit; do
+    ${LAMBDAPP} $flags "$test" > "$dir/got"
+    if ! cmp -s "$dir/expected" "$dir/got"; then
+      err '%s: output differs on a cache %s' "$test" $run
+      failed=1
+    fi
+  done
+  # the options are part of the key
+  LAMBDAPP_CACHE_DIR= ${LAMBDAPP} -S $flags "$test" > "$dir/expected" 2>&1
+  ${LAMBDAPP} -S $flags "$test" > "$dir/got" 2>&1
+  if ! cmp -s "$dir/expected" "$dir/got"; then
+    err '%s: output with -S differs' "$test"
+    failed=1
+  fi
+  count=$(( count + 1 ))
+done
+
+# every test missed twice (with and without -S) and hit once
+stats=$(${LAMBDAPP} --cache-stats | tr '\n' ' ')
+if [[ $stats != "hits $count misses $(( count * 2 )) " ]]; then
+  err 'unexpected cache statistics: %s' "$stats"
+  failed=1
+fi
+
+(( failed )) || msg 'All cache tests succeeded'
+exit $failed
@@ -0,0 +1,30 @@
+#include <stdio.h>
+
+void foreach(const int *values, int count, void (*func)(int, void *), void *env) {
+  for (int i = 0; i != count; i++)
+    func(values[i], env);
+}
+
+void call(void (*func)(void *), void *env) {
+  func(env);
+}
+
+int main(int argc, char **argv) {
+  int         values[] = { 1, 2, 3 };
+  int         scale = 10, sum = 0;
+  const char *name = "sum";
+  foreach(values, 3, lambda [int scale, int &sum] void(int v) {
+    *sum += v * scale;
+  });
+  call(lambda [const char *name, int sum] void(void) => printf("%s %i\n", name, sum););
+  foreach(values, 2, lambda [int scale] void(int v) {
+    foreach(&v, 1, lambda [int scale, int v] void(int w) => printf("%i %i\n", w * scale, v););
+  });
+  return 0;
+}
+
+/* OUTPUT:
+sum 60
+10 1
+20 2
+*/
@@ -0,0 +1,93 @@
+#!/usr/bin/env bash
+# Translates C++ with --cxx and checks that the lambdas without captures are
+# written as C++ lambdas, that the output compiles and runs the same, through
+# lambda-cc as well, and that __LINE__ still refers to the line in the source.
+
+LAMBDAPP="../lambda-pp"
+LAMBDACC="../lambda-cc"
+CXX="${CXX:-c++}"
+
+err() {
+  local mesg="$1"; shift
+  printf "*** ${mesg}\n" "$@" >&2
+}
+
+msg() {
+  local mesg="$1"; shift
+  printf "==> ${mesg}\n" "$@" >&2
+}
+
+die() {
+  err "$@"
+  exit 1
+}
+
+[[ -x ${LAMBDAPP} ]] || die 'failed to find lambdapp at: %s' "$LAMBDAPP"
+[[ -x ${LAMBDACC} ]] || die 'failed to find lambda-cc at: %s' "$LAMBDACC"
+if ! command -v "${CXX}" > /dev/null; then
+  msg 'Skipping the C++ tests, there is no %s' "$CXX"
+  exit 0
+fi
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+cat > "$dir/cxx.cc" <<'END'
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+
+static int three(void) { return 3; }
+static int apply(int (*f)(int), int x) { return f(x); }
+
+int main() {
+    int values[] = { 3, 1, 2 };
+    std::sort(values, values + 3, lambda bool(int a, int b) => return a > b;);
+    for (int v : values)
+        std::printf("%d ", v);
+    std::qsort(values, 3, sizeof(int), lambda int(const void *a, const void *b) {
+        return *(const int *)a - *(const int *)b;
+    });
+    int (*twice)(int) = lambda int(int x) => return apply(lambda int(int y) => return y * 2;, x);;
+    std::for_each(values, values + 3, lambda [[hot]] void(int v) {
+        static int calls;
+        std::printf("%d:%d ", ++calls, v);
+    });
+    /* returns a function pointer, which stays a function */
+    std::printf("%d %d\n", twice(21), lambda int (*(int x))(void) { (void)x; return &three; }(0)());
+    std::printf("%d\n", lambda int(void) => return __LINE__;());
+    return 0;
+}
+END
+printf '3 2 1 1:1 2:2 3:3 42 3\n23\n' > "$dir/expected"
+
+failed=0
+for flags in "" "--stream" "--markers=changed" "--markers=none --stable-names"; do
+  if ! ${LAMBDAPP} --cxx $flags "$dir/cxx.cc" -o "$dir/out.cc"; then
+    err 'failed to translate with %s' "$flags"
+    failed=1
+  elif [[ $(grep -o '(\[\](' "$dir/out.cc" | wc -l) != 6 ]]; then
+    err 'expected 6 C++ lambdas with %s' "$flags"
+    failed=1
+  elif ! ${CXX} -std=c++11 "$dir/out.cc" -o "$dir/cxx"; then
+    err 'failed to compile the output with %s' "$flags"
+    failed=1
+  elif [[ $flags != *none* ]] && ! "$dir/cxx" | cmp -s "$dir/expected" -; then
+    err 'wrong output with %s' "$flags"
+    failed=1
+  fi
+done
+
+# lambda-cc only takes it for C++ sources, in-process and through lambda-pp
+for pp in "" ..; do
+  if ! LAMBDA_PP=$pp CC=${CXX} ${LAMBDACC} --cxx -std=c++11 "$dir/cxx.cc" -o "$dir/cxx"; then
+    err 'failed to build with lambda-cc %s' "${pp:+through lambda-pp}"
+    failed=1
+  elif ! "$dir/cxx" | cmp -s "$dir/expected" -; then
+    err 'wrong output from lambda-cc %s' "${pp:+through lambda-pp}"
+    failed=1
+  fi
+done
+
+(( failed )) || msg 'All C++ tests succeeded'
+exit $failed
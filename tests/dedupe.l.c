@@ -0,0 +1,30 @@
+/* FLAGS: --dedupe */
+#include <stdio.h>
+
+typedef int (*func_t)(int);
+
+func_t twice(void) {
+  return lambda int(int x) => return x * 2;;
+}
+
+int main(int argc, char **argv) {
+  func_t a = lambda int(int x) => return x * 2;;
+  func_t b = lambda int(int x) => return x * 2;;
+  func_t c = lambda int(int x) => return x * 3;;
+  void (*outer)(func_t) = lambda void(func_t f) {
+    printf("%i\n", f(1) + (lambda int(int x) => return x * 2;)(1));
+  };
+  void (*again)(func_t) = lambda void(func_t f) {
+    printf("%i\n", f(1) + (lambda int(int x) => return x * 2;)(1));
+  };
+  printf("%i %i %i\n", a == b, a == twice(), a == c);
+  printf("%i\n", outer == again);
+  outer(c);
+  return 0;
+}
+
+/* OUTPUT:
+1 1 0
+1
+5
+*/
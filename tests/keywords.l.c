@@ -0,0 +1,18 @@
+/* FLAGS: -k lambda -k fn */
+#include <stdio.h>
+
+void apply(int x, int (*func)(int)) {
+  printf("%i\n", func(x));
+}
+
+int main(int argc, char **argv) {
+  int lambdas = 2, fns = 3;
+  apply(lambdas, lambda int(int x) { return x * 10; });
+  apply(fns, fn int(int x) => return x + 1;);
+  return 0;
+}
+
+/* OUTPUT:
+20
+4
+*/
@@ -0,0 +1,31 @@
+#include <stdio.h>
+
+/* A comment over
+ * several lines, which the line numbers have to count
+ */
+static int (*first)(void) = lambda int(void) {
+    return __LINE__;
+};
+
+static const char *text = "a string \
+over two lines";
+
+static int (*second)(void) = lambda int(void) {
+    // a comment
+    return __LINE__;
+};
+
+static int after = __LINE__;
+
+int main(void) {
+    printf("%d %d %d\n", first(), second(), after);
+    printf("%d\n", (lambda int(void) { return __LINE__; })());
+    printf("%d\n", __LINE__);
+    return text[0] != 'a';
+}
+
+/* OUTPUT:
+7 15 18
+22
+23
+*/
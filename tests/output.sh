@@ -0,0 +1,41 @@
+#!/usr/bin/env bash
+# Translates the tests which have an expected output in output/ with the
+# default options and checks the output is exactly that, #line markers and
+# all, which runtests.sh can't see as long as the result still runs.
+
+LAMBDAPP="../lambda-pp"
+
+err() {
+  local mesg="$1"; shift
+  printf "*** ${mesg}\n" "$@" >&2
+}
+
+msg() {
+  local mesg="$1"; shift
+  printf "==> ${mesg}\n" "$@" >&2
+}
+
+die() {
+  err "$@"
+  exit 1
+}
+
+[[ -x ${LAMBDAPP} ]] || die 'failed to find lambdapp at: %s' "$LAMBDAPP"
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+failed=0
+for expected in output/*.out; do
+  test=$(basename "$expected" .out)
+  if ! LAMBDAPP_CACHE_DIR= ${LAMBDAPP} "$test" > "$dir/got"; then
+    err '%s: translation failed' "$test"
+    failed=1
+  elif ! diff -u "$expected" "$dir/got" >&2; then
+    err '%s: output differs from %s' "$test" "$expected"
+    failed=1
+  fi
+done
+
+(( failed )) || msg 'All output tests succeeded'
+exit $failed
@@ -0,0 +1,91 @@
+#!/usr/bin/env bash
+# Translates inputs large enough to be parsed in segments on multiple threads
+# and checks that the output and the errors are the same as with one thread,
+# and that files translated into a directory at the same time don't collide.
+
+LAMBDAPP="../lambda-pp"
+
+err() {
+  local mesg="$1"; shift
+  printf "*** ${mesg}\n" "$@" >&2
+}
+
+msg() {
+  local mesg="$1"; shift
+  printf "==> ${mesg}\n" "$@" >&2
+}
+
+die() {
+  err "$@"
+  exit 1
+}
+
+[[ -x ${LAMBDAPP} ]] || die 'failed to find lambdapp at: %s' "$LAMBDAPP"
+
+# n top-level statements, every tenth one a lambda with a nested one
+gen_flat() {
+  awk -v n="$1" 'BEGIN {
+    for (i = 0; i < n; i++)
+      if (i % 10 == 0) printf "int (*f%d)(int) = lambda int(int x) { return (lambda int(void) => return %d;)() + x; };\n", i, i;
+      else printf "int g%d = %d;\n", i, i;
+  }'
+}
+
+# the flat input inside a comment between two lambdas, where none of the
+# boundaries is one
+gen_comment() {
+  echo 'int (*f)(int) = lambda int(int x) { return x; };'
+  echo '/*'
+  gen_flat "$1"
+  echo '*/'
+  echo 'int (*g)(int) = lambda int(int x) { return x; };'
+}
+
+# the flat input with an unterminated lambda at the end
+gen_error() {
+  gen_flat "$1"
+  echo 'int (*h)(void) = lambda int(void) { return 1;'
+}
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+failed=0
+for test in flat comment error; do
+  gen_$test 200000 > "$dir/$test.c"
+  for flags in "" "--stable-names" "--dedupe" "-S"; do
+    ${LAMBDAPP} $flags "$dir/$test.c" > "$dir/expected" 2>&1
+    for jobs in 2 5; do
+      ${LAMBDAPP} -j $jobs $flags "$dir/$test.c" > "$dir/got" 2>&1
+      if ! cmp -s "$dir/expected" "$dir/got"; then
+        err '%s: output with -j %d %s differs' $test $jobs "$flags"
+        failed=1
+      fi
+    done
+  done
+done
+
+# batch mode: files from different directories with the same name would end
+# up in the same output, which is an error before anything is translated
+mkdir -p "$dir/a" "$dir/b"
+gen_flat 100 > "$dir/a/x.c"
+gen_flat 200 > "$dir/b/y.l.c"
+cp "$dir/b/y.l.c" "$dir/b/x.c"
+if ! ${LAMBDAPP} -j 2 -o "$dir/out/" "$dir/a/x.c" "$dir/b/y.l.c"; then
+  err 'failed to translate files into a directory'
+  failed=1
+elif ! ${LAMBDAPP} "$dir/a/x.c" | cmp -s "$dir/out/x.c" - || ! ${LAMBDAPP} "$dir/b/y.l.c" | cmp -s "$dir/out/y.c" -; then
+  err 'wrong translations in the output directory'
+  failed=1
+fi
+rm -rf "$dir/out"
+if ${LAMBDAPP} -j 2 -o "$dir/out/" "$dir/a/x.c" "$dir/b/x.c" 2> /dev/null; then
+  err 'translated two files to the same output'
+  failed=1
+elif [[ -e $dir/out/x.c ]]; then
+  err 'wrote an output for files with the same name'
+  failed=1
+fi
+
+(( failed )) || msg 'All parallel tests succeeded'
+exit $failed
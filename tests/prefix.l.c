@@ -0,0 +1,18 @@
+/* FLAGS: --prefix=prefix */
+#include <stdio.h>
+
+/* the names lambdas get without a prefix are free to use */
+static int lambda_0(int x) { return x * 10; }
+
+static int apply(int (*f)(int), int x) { return f(x); }
+
+int main(int argc, char **argv) {
+  printf("%d\n", apply(lambda int(int x) { return lambda_0(x) + 1; }, 4));
+  printf("%d\n", apply(lambda_0, 5));
+  return 0;
+}
+
+/* OUTPUT:
+41
+50
+*/
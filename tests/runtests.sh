@@ -74,6 +74,12 @@ trytest() {
   fi
 }
 
+# extra lambdapp options: /* FLAGS: ... */ on the first line
+test_flags() {
+  local src="$1"
+  sed -ne '1s/^\/\* FLAGS: \(.*\) \*\/$/\1/p' "$src"
+}
+
 create_expect() {
   local src="$1"
   local dst="$2"
@@ -93,7 +99,8 @@ runtest() {
     msg 'FAIL: %s is illformatted' "$file"
     return
   fi
-  if ! preprocess "$file" "$csrc"; then
+  local flags=($(test_flags "$file"))
+  if ! preprocess "$file" "$csrc" "${flags[@]}"; then
     let testppfail++
     msg 'FAIL: %s failed to process' "$file"
     return
@@ -0,0 +1,86 @@
+#!/usr/bin/env bash
+# Translates synthetic inputs of growing size and fails when the time taken
+# grows much faster than the input does.
+
+LAMBDAPP="../lambda-pp"
+FACTOR=8        # size ratio of the large to the small input
+LIMIT=24        # a linear time ratio would be 8, a quadratic one 64
+
+err() {
+  local mesg="$1"; shift
+  printf "*** ${mesg}\n" "$@" >&2
+}
+
+msg() {
+  local mesg="$1"; shift
+  printf "==> ${mesg}\n" "$@" >&2
+}
+
+die() {
+  err "$@"
+  exit 1
+}
+
+[[ -x ${LAMBDAPP} ]] || die 'failed to find lambdapp at: %s' "$LAMBDAPP"
+
+# lambdas nested n levels deep
+gen_deep() {
+  awk -v n="$1" 'BEGIN {
+    printf "void (*f)(void) = ";
+    for (i = 0; i < n; i++) printf "lambda void(void) { g(";
+    printf "0";
+    for (i = 0; i < n; i++) printf "); }";
+    printf ";\n";
+  }'
+}
+
+# n top-level statements, every tenth one a lambda
+gen_flat() {
+  awk -v n="$1" 'BEGIN {
+    for (i = 0; i < n; i++)
+      if (i % 10 == 0) printf "int (*f%d)(int) = lambda int(int x) { return x + %d; };\n", i, i;
+      else printf "int g%d = %d;\n", i, i;
+  }'
+}
+
+# n lambdas inside a single function
+gen_wide() {
+  awk -v n="$1" 'BEGIN {
+    printf "void f(void) {\n";
+    for (i = 0; i < n; i++) printf "  call(lambda void(int i) { use(i, %d); });\n", i;
+    printf "}\n";
+  }'
+}
+
+# best of three, in microseconds
+timeit() {
+  local best=0
+  for run in 1 2 3; do
+    local start=$(date +%s%N)
+    ${LAMBDAPP} "$1" > /dev/null || die 'failed to process %s' "$1"
+    local took=$(( ($(date +%s%N) - start) / 1000 ))
+    (( best == 0 || took < best )) && best=$took
+  done
+  echo $best
+}
+
+input=$(mktemp)
+trap 'rm -f "$input"' EXIT
+
+failed=0
+for test in deep:4000 flat:40000 wide:10000; do
+  name=${test%:*}
+  size=${test#*:}
+  gen_$name $size > "$input"
+  small=$(timeit "$input")
+  gen_$name $(( size * FACTOR )) > "$input"
+  large=$(timeit "$input")
+  (( small > 0 )) || small=1
+  ratio=$(( large / small ))
+  msg '%-5s %7d: %7dus, %7d: %7dus, ratio %d' $name $size $small $(( size * FACTOR )) $large $ratio
+  if (( ratio > LIMIT )); then
+    err '%s: time grows faster than the input' $name
+    failed=1
+  fi
+done
+exit $failed
@@ -0,0 +1,84 @@
+#!/usr/bin/env bash
+# Runs the tests through a server and checks the output matches the one of
+# translating them directly, both for fresh and for cached translations.
+
+LAMBDAPP="../lambda-pp"
+
+err() {
+  local mesg="$1"; shift
+  printf "*** ${mesg}\n" "$@" >&2
+}
+
+msg() {
+  local mesg="$1"; shift
+  printf "==> ${mesg}\n" "$@" >&2
+}
+
+die() {
+  err "$@"
+  exit 1
+}
+
+[[ -x ${LAMBDAPP} ]] || die 'failed to find lambdapp at: %s' "$LAMBDAPP"
+
+dir=$(mktemp -d)
+socket="$dir/socket"
+${LAMBDAPP} --server "$socket" -j 2 &
+server=$!
+trap 'kill $server; wait $server 2>/dev/null; rm -rf "$dir"' EXIT
+
+for (( tries = 0; tries < 50; tries++ )); do
+  [[ -S $socket ]] && break
+  sleep 0.1
+done
+[[ -S $socket ]] || die 'the server did not start'
+
+# the first line of a test may hold the flags it needs
+test_flags() {
+  sed -n '1s/^\/\* FLAGS: \(.*\) \*\/$/\1/p' "$1"
+}
+
+failed=0
+for test in *.l.c; do
+  flags=$(test_flags "$test")
+  ${LAMBDAPP} $flags "$test" > "$dir/expected" 2>&1
+  for run in fresh cached; do
+    ${LAMBDAPP} --client "$socket" $flags "$test" > "$dir/got" 2>&1
+    if ! cmp -s "$dir/expected" "$dir/got"; then
+      err '%s: %s output differs' "$test" $run
+      failed=1
+    fi
+  done
+done
+
+# a changed file must not be served from the cache
+printf 'int (*f)(void) = lambda int(void) { return 1; };\n' > "$dir/change.c"
+${LAMBDAPP} --client "$socket" "$dir/change.c" > /dev/null
+printf 'int (*g)(void) = lambda int(void) { return 2; };\n' > "$dir/change.c"
+${LAMBDAPP} "$dir/change.c" > "$dir/expected"
+${LAMBDAPP} --client "$socket" "$dir/change.c" > "$dir/got"
+if ! cmp -s "$dir/expected" "$dir/got"; then
+  err 'a changed file was served from the cache'
+  failed=1
+fi
+
+# a client which doesn't read its cached output doesn't hold up the others
+awk 'BEGIN { for (i = 0; i < 50000; i++) printf "int (*f%d)(int) = lambda int(int x) { return x + %d; };\n", i, i }' > "$dir/large.c"
+${LAMBDAPP} --client "$socket" "$dir/large.c" > /dev/null
+${LAMBDAPP} --client "$socket" "$dir/large.c" | sleep 3 &
+stalled=$!
+sleep 0.5
+if ! timeout 2 ${LAMBDAPP} --client "$socket" "$dir/large.c" > /dev/null; then
+  err 'a stalled client held up the cache'
+  failed=1
+fi
+wait $stalled
+
+# errors are reported to the client
+if printf 'int x = lambda int(\n' | ${LAMBDAPP} --client "$socket" > /dev/null 2>&1; then
+  err 'a failed translation did not fail the client'
+  failed=1
+fi
+
+(( failed )) || msg 'All server tests succeeded'
+exit $failed
@@ -0,0 +1,25 @@
+/* FLAGS: --stable-names */
+#include <stdio.h>
+
+void call(void (*func)(void)) {
+  func();
+}
+
+int main(int argc, char **argv) {
+  call(lambda void(void) { printf("same\n"); });
+  call(lambda void(void) {
+    printf("outer\n");
+    call(lambda void(void) { printf("same\n"); });
+  });
+  call(lambda void(void) { printf("same\n"); });
+  call(lambda void(void) => printf("short\n"););
+  return 0;
+}
+
+/* OUTPUT:
+same
+outer
+same
+same
+short
+*/
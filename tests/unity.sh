@@ -0,0 +1,63 @@
+#!/usr/bin/env bash
+# Translates files into one unity output and checks that it compiles, that
+# the lambdas of files with the same names don't collide, and that __LINE__
+# still refers to the line in each file.
+
+LAMBDAPP="../lambda-pp"
+CC="${CC:-cc}"
+
+err() {
+  local mesg="$1"; shift
+  printf "*** ${mesg}\n" "$@" >&2
+}
+
+msg() {
+  local mesg="$1"; shift
+  printf "==> ${mesg}\n" "$@" >&2
+}
+
+die() {
+  err "$@"
+  exit 1
+}
+
+[[ -x ${LAMBDAPP} ]] || die 'failed to find lambdapp at: %s' "$LAMBDAPP"
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+# a file with a lambda on line 5 of it, called from a function named $1
+gen_unit() {
+  printf '#include <stdio.h>\n'
+  printf 'static int apply_%s(int (*f)(int), int x) { return f(x); }\n' "$1"
+  printf 'void %s(void) {\n' "$1"
+  printf '  int line =\n'
+  printf '    apply_%s(lambda int(int x) {\n      return x + %d; }, __LINE__);\n' "$1" "$2"
+  printf '  printf("%s %%d\\n", line);\n' "$1"
+  printf '}\n'
+}
+
+mkdir -p "$dir/a-b"
+gen_unit one 100 > "$dir/a-b.c"
+gen_unit two 200 > "$dir/a_b.c"
+gen_unit three 300 > "$dir/a-b/c.c"
+printf 'void one(void); void two(void); void three(void);\n' > "$dir/main.c"
+printf 'int main(void) { one(); two(); three(); return 0; }\n' >> "$dir/main.c"
+printf 'one 105\ntwo 205\nthree 305\n' > "$dir/expected"
+
+failed=0
+for flags in "" "--stable-names" "--markers=changed" "--stream"; do
+  if ! ${LAMBDAPP} --unity $flags "$dir/a-b.c" "$dir/a_b.c" "$dir/a-b/c.c" -o "$dir/unity.c"; then
+    err 'failed to translate with %s' "$flags"
+    failed=1
+  elif ! ${CC} -std=c11 "$dir/unity.c" "$dir/main.c" -o "$dir/unity"; then
+    err 'failed to compile the output with %s' "$flags"
+    failed=1
+  elif ! "$dir/unity" | cmp -s "$dir/expected" -; then
+    err 'wrong output with %s' "$flags"
+    failed=1
+  fi
+done
+
+(( failed )) || msg 'All unity tests succeeded'
+exit $failed
@@ -0,0 +1,115 @@
+#!/usr/bin/env bash
+# Runs lambda-pp --watch on a directory tree and checks that the mirror
+# follows changes to it, and that outputs are only replaced when their
+# translation changes.
+
+LAMBDAPP="../lambda-pp"
+
+err() {
+  local mesg="$1"; shift
+  printf "*** ${mesg}\n" "$@" >&2
+}
+
+msg() {
+  local mesg="$1"; shift
+  printf "==> ${mesg}\n" "$@" >&2
+}
+
+die() {
+  err "$@"
+  exit 1
+}
+
+[[ -x ${LAMBDAPP} ]] || die 'failed to find lambdapp at: %s' "$LAMBDAPP"
+
+dir=$(mktemp -d)
+watcher=
+trap '[[ -n $watcher ]] && kill $watcher 2>/dev/null; rm -rf "$dir"' EXIT
+
+# waits up to 5 seconds for the condition to be true
+wait_for() {
+  for (( i = 0; i < 50; i++ )); do
+    eval "$1" && return 0
+    sleep 0.1
+  done
+  return 1
+}
+
+# starts the watcher and waits for it to translate $1 files
+start() {
+  rm -f "$dir/stats"
+  ${LAMBDAPP} --watch="$dir/src" -o "$dir/out" --stats="$dir/stats" 2> "$dir/errors" &
+  watcher=$!
+  wait_for "[[ \$(cat '$dir/stats' 2>/dev/null | wc -l) == $1 ]]"
+}
+
+stop() {
+  kill $watcher
+  wait $watcher 2>/dev/null
+  watcher=
+}
+
+mtime() {
+  stat -c %y "$1"
+}
+
+mkdir -p "$dir/src/sub" "$dir/src/.git"
+printf 'int (*f)(int) = lambda int(int x) => return x;;\n' > "$dir/src/a.l.c"
+printf 'int b;\n' > "$dir/src/sub/b.h"
+printf 'not a source\n' > "$dir/src/notes.txt"
+printf 'int hidden;\n' > "$dir/src/.git/c.c"
+
+failed=0
+check() {
+  if ! wait_for "$1"; then
+    err "$2"
+    failed=1
+  fi
+}
+
+start 2
+check '[[ -f $dir/out/a.c && -f $dir/out/sub/b.h ]]' 'the sources were not translated'
+[[ -e $dir/out/notes.txt || -e $dir/out/.git ]] && { err 'translated files which are not sources'; failed=1; }
+grep -q 'lambda_0' "$dir/out/a.c" || { err 'wrong translation of a.l.c'; failed=1; }
+
+# touching a file, or writing the same content, leaves its output alone; the
+# change to b.h after it shows when they have been seen
+before=$(mtime "$dir/out/a.c")
+sleep 0.05
+touch "$dir/src/a.l.c"
+cat "$dir/src/a.l.c" > "$dir/src/a.tmp" && mv "$dir/src/a.tmp" "$dir/src/a.l.c"
+printf 'int b2;\n' > "$dir/src/sub/b.h"
+check 'grep -q b2 "$dir/out/sub/b.h"' 'a changed file was not translated again'
+[[ $(mtime "$dir/out/a.c") == "$before" ]] || { err 'an unchanged file was replaced'; failed=1; }
+
+printf 'int (*f)(int) = lambda int(int x) => return x + 1;;\n' > "$dir/src/a.l.c"
+check 'grep -q "x + 1" "$dir/out/a.c"' 'an edit was not translated'
+
+# new directories are watched, removed sources lose their outputs
+mkdir -p "$dir/src/new/deep"
+printf 'int (*k)(void) = lambda int(void) => return 0;;\n' > "$dir/src/new/deep/k.c"
+check '[[ -f $dir/out/new/deep/k.c ]]' 'a file in a new directory was not translated'
+rm "$dir/src/sub/b.h"
+check '[[ ! -e $dir/out/sub/b.h ]]' 'the output of a removed file is still there'
+mv "$dir/src/new" "$dir/moved"
+check '[[ ! -e $dir/out/new/deep/k.c ]]' 'the outputs of a moved directory are still there'
+
+# a parse error is reported and the watch goes on
+printf 'int (*e)(void) = lambda int(void) {\n' > "$dir/src/e.c"
+check 'grep -q "e.c:" "$dir/errors"' 'a parse error was not reported'
+printf 'int (*e)(void) = lambda int(void) { return 1; };\n' > "$dir/src/e.c"
+check '[[ -f $dir/out/e.c ]]' 'a fixed file was not translated'
+
+# a new watcher translates everything again, but doesn't replace anything
+stop
+before=$(mtime "$dir/out/a.c")
+start 2 || { err 'the watcher did not translate the tree again'; failed=1; }
+[[ $(mtime "$dir/out/a.c") == "$before" ]] || { err 'a restart replaced an unchanged output'; failed=1; }
+
+# it stops when the directory is gone
+rm -rf "$dir/src"
+wait_for '! kill -0 $watcher 2>/dev/null' || { err 'the watcher kept running without its directory'; failed=1; }
+watcher=
+
+(( failed )) || msg 'All watch tests succeeded'
+exit $failed